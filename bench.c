@@ -0,0 +1,159 @@
+/*
+ * linux/fs/sfs/bench.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "simplefs.h"
+
+/*
+ * Microbenchmarks for the block allocator and the dentry scan, run on
+ * synthetic in-memory data when the module is loaded. Only built with
+ * make SIMPLEFS_BENCH=y. Results go to the kernel log as ns/op plus the
+ * number of bits or dentries looked at per op.
+ */
+
+#define BENCH_OPS 10000
+#define BENCH_BITMAP_BLOCKS 2
+
+static const int bench_fill[] = { 0, 50, 90, 99 };
+static const int bench_tombstones[] = { 0, 50, 90 };
+#define BENCH_DIR_BYTES (SIMPLEFS_BLOCKS_PER_INODE * SIMPLEFS_BLOCKSIZE)
+
+static const int bench_entries[] = { 16, 64, BENCH_DIR_BYTES / SIMPLEFS_DENTRY_SIZE };
+
+/*
+ * Set fill percent of the bits, either packed at the start of the
+ * bitmap or scattered over it.
+ */
+static void bench_fill_bitmap(unsigned long **maps, int fill, int scattered) {
+	int i, nr, nbits = SIMPLEFS_BLOCKSIZE * 8;
+
+	for (i = 0; i < BENCH_BITMAP_BLOCKS; i++) {
+		memset(maps[i], 0, SIMPLEFS_BLOCKSIZE);
+		for (nr = 0; nr < nbits; nr++) {
+			if (scattered ? random32() % 100 < fill
+			    : i * nbits + nr < BENCH_BITMAP_BLOCKS * nbits * fill / 100)
+				set_bit(nr, maps[i]);
+		}
+	}
+}
+
+/* one allocation the way bitmap_claim does it, undone afterwards */
+static void bench_alloc(unsigned long **maps, unsigned long *scanned) {
+	int i, nr, nbits = SIMPLEFS_BLOCKSIZE * 8;
+
+	for (i = 0; i < BENCH_BITMAP_BLOCKS; i++) {
+		if ((nr = bitmap_find_set_bit(maps[i], nbits, 0)) >= 0) {
+			*scanned += nr + 1;
+			clear_bit(nr, maps[i]);
+			return;
+		}
+		*scanned += nbits;
+	}
+}
+
+static void bench_bitmap(void) {
+	unsigned long *maps[BENCH_BITMAP_BLOCKS], scanned;
+	int i, f, nmaps, scattered;
+	ktime_t start;
+	s64 ns;
+
+	for (nmaps = 0; nmaps < BENCH_BITMAP_BLOCKS; nmaps++) {
+		if (!(maps[nmaps] = kmalloc(SIMPLEFS_BLOCKSIZE, GFP_KERNEL)))
+			goto out;
+	}
+	for (scattered = 0; scattered < 2; scattered++) {
+		for (f = 0; f < ARRAY_SIZE(bench_fill); f++) {
+			bench_fill_bitmap(maps, bench_fill[f], scattered);
+			scanned = 0;
+			start = ktime_get();
+			for (i = 0; i < BENCH_OPS; i++)
+				bench_alloc(maps, &scanned);
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+			printk(KERN_INFO "simplefs_bench: alloc %s fill:%d%% %llu ns/op %lu bits/op\n",
+			       scattered ? "scattered" : "packed", bench_fill[f],
+			       div_u64(ns, BENCH_OPS), scanned / BENCH_OPS);
+			cond_resched();
+		}
+	}
+ out:
+	while (--nmaps >= 0)
+		kfree(maps[nmaps]);
+}
+
+/*
+ * Build a directory of n dentries named f0, f1, ... packed back to
+ * back the way simplefs_insert_dentry appends them, with tombstones
+ * percent of them deleted.
+ */
+static void bench_fill_dir(char *dir, char (*names)[SIMPLEFS_NAME_LEN], int n, int tombstones) {
+	struct simplefs_dentry *de = (struct simplefs_dentry *)dir;
+	int i;
+
+	for (i = 0; i < n; i++, de++) {
+		memset(de, 0, sizeof(*de));
+		de->inode = i + 1;
+		de->flags = random32() % 100 < tombstones ? SIMPLEFS_DENTRY_UNUSED : SIMPLEFS_DENTRY_INUSED;
+		strncpy(de->name, names[i], SIMPLEFS_NAME_LEN);
+	}
+}
+
+/* look a name up the way simplefs_find_dentry scans a directory, a page at a time */
+static int bench_lookup(char *dir, int n, const char *name, unsigned long *scanned) {
+	unsigned long p, size = n * SIMPLEFS_DENTRY_SIZE;
+
+	for (p = 0; p < size; p += PAGE_CACHE_SIZE) {
+		if (simplefs_scan_dentries(dir + p, min_t(unsigned long, size - p, PAGE_CACHE_SIZE),
+					   name, strlen(name), scanned))
+			return 1;
+	}
+	return 0;
+}
+
+static void bench_dentry(void) {
+	int max = bench_entries[ARRAY_SIZE(bench_entries) - 1];
+	int i, e, t, n, hits;
+	char (*names)[SIMPLEFS_NAME_LEN];
+	char *dir;
+	unsigned long scanned;
+	ktime_t start;
+	s64 ns;
+
+	if (!(names = kmalloc(max * SIMPLEFS_NAME_LEN, GFP_KERNEL)))
+		return;
+	if (!(dir = kmalloc(BENCH_DIR_BYTES, GFP_KERNEL)))
+		goto out;
+	for (i = 0; i < max; i++)
+		snprintf(names[i], SIMPLEFS_NAME_LEN, "f%d", i);
+	for (e = 0; e < ARRAY_SIZE(bench_entries); e++) {
+		for (t = 0; t < ARRAY_SIZE(bench_tombstones); t++) {
+			bench_fill_dir(dir, names, bench_entries[e], bench_tombstones[t]);
+			scanned = hits = 0;
+			start = ktime_get();
+			/* names in a scattered but fixed order, tombstoned ones miss */
+			for (i = 0, n = 0; i < BENCH_OPS; i++, n = (n + 7919) % bench_entries[e])
+				hits += bench_lookup(dir, bench_entries[e], names[n], &scanned);
+			ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+			printk(KERN_INFO "simplefs_bench: lookup entries:%d tombstones:%d%% "
+			       "%llu ns/op %lu entries/op %d%% hits\n",
+			       bench_entries[e], bench_tombstones[t], div_u64(ns, BENCH_OPS),
+			       scanned / BENCH_OPS, hits * 100 / BENCH_OPS);
+			cond_resched();
+		}
+	}
+	kfree(dir);
+ out:
+	kfree(names);
+}
+
+void simplefs_bench(void) {
+	bench_bitmap();
+	bench_dentry();
+}
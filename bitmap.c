@@ -1,3 +1,4 @@
+#include <linux/bitmap.h>
 #include <linux/buffer_head.h>
 #include <asm-generic/bitops/find.h>
 #include "simplefs.h"
@@ -12,89 +13,351 @@ struct buffer_head *bitmap_load(struct super_block *sb, sector_t block) {
 	return bh;
 }
 
-static int bitmap_alloc_bit(struct buffer_head *bh) {
-	int nr = -1;
+/*
+ * Bitmap and refcount blocks are read the first time the allocator
+ * needs them rather than at mount, so mount time does not depend on
+ * the size of the device. The next few blocks are read ahead.
+ *
+ * Each bitmap block also gets an in-memory copy, made when it is read.
+ * Allocators claim bits in the copy, then set the ones they won on
+ * disk as one batch (see bitmap_write_bits). The numbers held by the
+ * per-cpu caches (see reserve.c) are therefore used on disk too until
+ * the caches are drained.
+ */
+#define BITMAP_READAHEAD 8
 
-	nr = find_first_zero_bit((unsigned long *)bh->b_data, bh->b_size * 8);
-	//int nr = minix_find_first_zero_bit((unsigned long *)bh->b_data, bh->b_size * 8);
-	if (nr < 0) {
-		printk(KERN_ERR "bitmap_alloc_bit failed\n");
-		goto out;
+static struct buffer_head *bitmap_get(struct super_block *sb, struct buffer_head **table,
+				      unsigned long **claimed, sector_t start, int i, int nr) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	int j;
+
+	if ((bh = ACCESS_ONCE(table[i]))) {
+		smp_rmb();
+		return bh;
+	}
+	mutex_lock(&sbi->s_bitmap_mutex);
+	if (!(bh = table[i])) {
+		for (j = i; j < nr && j <= i + BITMAP_READAHEAD; j++) {
+			if (!table[j])
+				sb_breadahead(sb, start + j);
+		}
+		if ((bh = bitmap_load(sb, start + i)) && claimed) {
+			if ((claimed[i] = kmalloc(SIMPLEFS_BLOCKSIZE, GFP_NOFS))) {
+				memcpy(claimed[i], bh->b_data, SIMPLEFS_BLOCKSIZE);
+			} else {
+				brelse(bh);
+				bh = NULL;
+			}
+		}
+		if (bh) {
+			smp_wmb();
+			table[i] = bh;
+		}
 	}
-	set_bit(nr, (unsigned long *)bh->b_data);
+	mutex_unlock(&sbi->s_bitmap_mutex);
+	return bh;
+}
 
-	//minix_set_bit(nr, (unsigned long *)bh->b_data);
-	mark_buffer_dirty(bh);
-	printk(KERN_WARNING "bitmap_alloc_bit ok: %d\n", nr);
- out:
-	return nr;
+/* the i-th bitmap block and its in-memory copy in *claimed */
+static struct buffer_head *bitmap_block(struct super_block *sb, int i, unsigned long **claimed) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+
+	bh = bitmap_get(sb, sbi->s_bitmaps, sbi->s_claimed, SIMPLEFS_BITMAP_BNO, i,
+			sbi->raw_super.s_inode_bitmap_blknr + sbi->raw_super.s_block_bitmap_blknr);
+	if (bh)
+		*claimed = sbi->s_claimed[i];
+	return bh;
+}
+
+static sector_t bitmap_refcount_start(struct simplefs_super_info *sbi) {
+	return SIMPLEFS_BITMAP_BNO + sbi->raw_super.s_inode_bitmap_blknr
+		+ sbi->raw_super.s_block_bitmap_blknr + sbi->raw_super.s_inode_blknr;
 }
 
-static void bitmap_free_bit(struct buffer_head *bh, int nr) {
+/*
+ * Start reading the first bitmap blocks at mount without waiting
+ * for them.
+ */
+void bitmap_readahead(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	int i;
+
+	for (i = 0; i < sbi->raw_super.s_inode_bitmap_blknr && i < BITMAP_READAHEAD; i++)
+		sb_breadahead(sb, SIMPLEFS_BITMAP_BNO + i);
+	for (i = 0; i < sbi->raw_super.s_block_bitmap_blknr && i < BITMAP_READAHEAD; i++)
+		sb_breadahead(sb, SIMPLEFS_BITMAP_BNO + sbi->raw_super.s_inode_bitmap_blknr + i);
+}
+
+/*
+ * Find the first clear bit at or after start in a bitmap of nbits
+ * bits and set it. Returns -1 when there is none. Safe against other
+ * allocators working on the same bitmap.
+ */
+int bitmap_find_set_bit(unsigned long *map, int nbits, int start) {
+	int nr;
+
+	for (nr = start; (nr = find_next_zero_bit(map, nbits, nr)) < nbits; nr++) {
+		if (!test_and_set_bit(nr, map))
+			return nr;
+	}
+	return -1;
+}
+
+/*
+ * Set on disk, or clear on disk and in the copy, the n bits in nrs,
+ * counted from bitmap block first. Each bitmap block is marked dirty
+ * once per run of numbers in it rather than once per bit. Bits are
+ * cleared on disk before the copy, so one claimed again at once is
+ * not cleared after it was set.
+ */
+static void bitmap_write_bits(struct super_block *sb, int first, long *nrs, int n, int set) {
+	struct buffer_head *bh = NULL;
+	unsigned long *claimed;
+	int i, b, cur = -1, nbits = SIMPLEFS_BLOCKSIZE * 8;
+
+	for (i = 0; i < n; i++) {
+		if ((b = first + nrs[i] / nbits) != cur) {
+			if (bh)
+				mark_buffer_dirty(bh);
+			cur = b;
+			bh = bitmap_block(sb, b, &claimed);
+		}
+		if (!bh)
+			continue;
+		if (set) {
+			set_bit(nrs[i] % nbits, (unsigned long *)bh->b_data);
+		} else {
+			clear_bit(nrs[i] % nbits, (unsigned long *)bh->b_data);
+			clear_bit(nrs[i] % nbits, claimed);
+		}
+	}
+	if (bh)
+		mark_buffer_dirty(bh);
+}
+
+/*
+ * Claim up to count clear bits in the in-memory copies of the nr
+ * bitmap blocks that start at bitmap block first, searching from bit
+ * goal and wrapping around. Their numbers, counted from the first bit,
+ * go to nrs. Returns how many were claimed, already set on disk.
+ */
+static int bitmap_claim(struct super_block *sb, int first, int nr, long goal, long *nrs, int count) {
+	unsigned long *map;
+	int i, k, bit, n = 0, start, nbits = SIMPLEFS_BLOCKSIZE * 8;
+	int goal_block;
+
+	if ((goal_block = goal / nbits) >= nr)
+		goal_block = goal = 0;
+	/* the goal's bitmap block is looked at again from its start last */
+	for (k = 0; k <= nr && n < count; k++) {
+		i = (goal_block + k) % nr;
+		if (!bitmap_block(sb, first + i, &map))
+			continue;
+		start = k ? 0 : goal % nbits;
+		while (n < count && (bit = bitmap_find_set_bit(map, nbits, start)) >= 0) {
+			nrs[n++] = bit + i * nbits;
+			start = bit + 1;
+		}
+	}
+	bitmap_write_bits(sb, first, nrs, n, 1);
+	return n;
+}
+
+static void bitmap_free_bit(struct buffer_head *bh, unsigned long *claimed, int nr) {
 	clear_bit(nr, (unsigned long *)bh->b_data);
 	//minix_test_and_clear_bit(nr, (unsigned long *)bh->b_data);
 	mark_buffer_dirty(bh);
+	clear_bit(nr, claimed);
 	printk(KERN_WARNING "bitmap_free_bit ok: %d\n", nr);
 }
 
-long bitmap_alloc_inode(struct super_block *sb) {
+/* claim up to count free inode numbers, for the per-cpu caches */
+int bitmap_reserve_inodes(struct super_block *sb, long *inos, int count) {
 	struct simplefs_super_info *sbi = sb->s_fs_info;
-	int i;
-	long ino = -1;
 
-	for (i = 0; i < sbi->raw_super.s_inode_bitmap_blknr; i++) {
-		ino = bitmap_alloc_bit(sbi->s_bitmaps[i]);
-		if (ino >= 0) {
-			ino += i * SIMPLEFS_BLOCKSIZE * 8;
-			break;
-		}
-	}
-	printk(KERN_WARNING "bitmap_alloc_inode ok: %ld\n", ino);
-	return ino;
+	return bitmap_claim(sb, 0, sbi->raw_super.s_inode_bitmap_blknr, 0, inos, count);
+}
+
+/* give back n inode numbers claimed by bitmap_reserve_inodes and never used */
+void bitmap_unreserve_inodes(struct super_block *sb, long *inos, int n) {
+	bitmap_write_bits(sb, 0, inos, n, 0);
 }
 
 void bitmap_free_inode(struct super_block *sb, long ino) {
-	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	unsigned long *claimed;
 	int i;
 
 	i = ino / (SIMPLEFS_BLOCKSIZE * 8);
 	ino -= (i * SIMPLEFS_BLOCKSIZE * 8);
-	bitmap_free_bit(sbi->s_bitmaps[i], ino);
+	if (!(bh = bitmap_block(sb, i, &claimed))) {
+		printk(KERN_ERR "bitmap_free_inode failed: %ld\n", ino);
+		return;
+	}
+	bitmap_free_bit(bh, claimed, ino);
 	printk(KERN_WARNING "bitmap_free_inode ok: %ld\n", ino);
 }
 
 
-long bitmap_alloc_block(struct super_block *sb) {
+/*
+ * Data blocks follow the inode table and the refcount table.
+ */
+long bitmap_data_start(struct simplefs_super_info *sbi) {
+	return SIMPLEFS_SUPER_BNO + 1 + sbi->raw_super.s_inode_bitmap_blknr
+		+ sbi->raw_super.s_block_bitmap_blknr + sbi->raw_super.s_inode_blknr
+		+ sbi->raw_super.s_refcount_blknr;
+}
+
+/*
+ * Claim up to count free data blocks at or after goal, counted from
+ * the start of the data area, wrapping around to the start when the
+ * rest is full.
+ */
+int bitmap_reserve_blocks(struct super_block *sb, long goal, long *bnos, int count) {
 	struct simplefs_super_info *sbi = sb->s_fs_info;
-	int i, ino_bitmap_blknr, bno_bitmap_blknr;
-	long bno = -1, real_bno = -1;
+	int i, n;
 
-	ino_bitmap_blknr = sbi->raw_super.s_inode_bitmap_blknr;
-	bno_bitmap_blknr = sbi->raw_super.s_block_bitmap_blknr;
-	for (i = 0; i < bno_bitmap_blknr; i++) {
-		bno = bitmap_alloc_bit(sbi->s_bitmaps[i + ino_bitmap_blknr]);
-		if (bno >= 0) {
-			bno += i * SIMPLEFS_BLOCKSIZE * 8;
-			real_bno = bno + SIMPLEFS_SUPER_BNO + 1 + ino_bitmap_blknr
-				+ bno_bitmap_blknr + sbi->raw_super.s_inode_blknr;
-			break;
+	n = bitmap_claim(sb, sbi->raw_super.s_inode_bitmap_blknr, sbi->raw_super.s_block_bitmap_blknr,
+			 goal, bnos, count);
+	for (i = 0; i < n; i++)
+		bnos[i] += bitmap_data_start(sbi);
+	return n;
+}
+
+/*
+ * Give back n data blocks claimed by bitmap_reserve_blocks and never
+ * used. The numbers in bnos are overwritten.
+ */
+void bitmap_unreserve_blocks(struct super_block *sb, long *bnos, int n) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	int i;
+
+	for (i = 0; i < n; i++)
+		bnos[i] -= bitmap_data_start(sbi);
+	bitmap_write_bits(sb, sbi->raw_super.s_inode_bitmap_blknr, bnos, n, 0);
+}
+
+/*
+ * Allocate count contiguous data blocks, for defrag, searching from
+ * goal like bitmap_reserve_blocks. A run does not cross a bitmap block.
+ * Bits are claimed one at a time with test_and_set_bit, and a run
+ * that loses a bit to another allocator is given back and searched
+ * again further on. The run is in use, on disk too, once this returns.
+ */
+long bitmap_alloc_range(struct super_block *sb, int count, long goal) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh;
+	unsigned long *map, nr, start, nbits = SIMPLEFS_BLOCKSIZE * 8;
+	int i, j, k, first, nr_bitmaps = sbi->raw_super.s_block_bitmap_blknr;
+
+	if ((first = goal / nbits) >= nr_bitmaps)
+		first = goal = 0;
+	for (k = 0; k <= nr_bitmaps; k++) {
+		i = (first + k) % nr_bitmaps;
+		if (!(bh = bitmap_block(sb, i + sbi->raw_super.s_inode_bitmap_blknr, &map)))
+			continue;
+		start = k ? 0 : goal % nbits;
+	retry:
+		if ((nr = bitmap_find_next_zero_area(map, nbits, start, count, 0)) >= nbits)
+			continue;
+		for (j = 0; j < count; j++) {
+			if (test_and_set_bit(nr + j, map)) {
+				while (--j >= 0)
+					clear_bit(nr + j, map);
+				start = nr + 1;
+				goto retry;
+			}
 		}
+		for (j = 0; j < count; j++)
+			set_bit(nr + j, (unsigned long *)bh->b_data);
+		mark_buffer_dirty(bh);
+		printk(KERN_WARNING "bitmap_alloc_range ok: %lu %d\n", nr, count);
+		return nr + i * nbits + bitmap_data_start(sbi);
 	}
-	printk(KERN_WARNING "bitmap_alloc_block ok: %ld\n", real_bno);
-	return real_bno;
+	return -ENOSPC;
+}
+
+/*
+ * Returns the refcount byte of a data block, or NULL when the image
+ * has no refcount table or it can't be read. May sleep.
+ */
+static unsigned char *bitmap_ref(struct super_block *sb, long bno,
+				 struct buffer_head **bh) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+
+	if (!sbi->s_refcounts)
+		return NULL;
+	if (!(*bh = bitmap_get(sb, sbi->s_refcounts, NULL, bitmap_refcount_start(sbi),
+			       bno / SIMPLEFS_BLOCKSIZE, sbi->raw_super.s_refcount_blknr)))
+		return NULL;
+	return (unsigned char *)(*bh)->b_data + bno % SIMPLEFS_BLOCKSIZE;
 }
 
 void bitmap_free_block(struct super_block *sb, long real_bno) {
 	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *bh, *ref_bh;
+	unsigned long *claimed;
+	unsigned char *ref;
 	int i, ino_bitmap_blknr, bno_bitmap_blknr;
 	long bno = -1;
 
 	ino_bitmap_blknr = sbi->raw_super.s_inode_bitmap_blknr;
 	bno_bitmap_blknr = sbi->raw_super.s_block_bitmap_blknr;
-	bno = real_bno - sbi->raw_super.s_inode_blknr -
-		ino_bitmap_blknr - bno_bitmap_blknr - SIMPLEFS_SUPER_BNO - 1;
+	bno = real_bno - bitmap_data_start(sbi);
+
+	/* a shared block only loses one owner */
+	ref = bitmap_ref(sb, bno, &ref_bh);
+	spin_lock(&sbi->s_ref_lock);
+	if (ref && *ref) {
+		(*ref)--;
+		spin_unlock(&sbi->s_ref_lock);
+		mark_buffer_dirty(ref_bh);
+		printk(KERN_WARNING "bitmap_free_block shared: %ld -> %d\n", real_bno, *ref);
+		return;
+	}
+	spin_unlock(&sbi->s_ref_lock);
+
 	i = bno / (SIMPLEFS_BLOCKSIZE * 8);
 	bno -= (i * SIMPLEFS_BLOCKSIZE * 8);
-	bitmap_free_bit(sbi->s_bitmaps[i + ino_bitmap_blknr], bno);
+	if (!(bh = bitmap_block(sb, i + ino_bitmap_blknr, &claimed))) {
+		printk(KERN_ERR "bitmap_free_block failed: %ld\n", real_bno);
+		return;
+	}
+	bitmap_free_bit(bh, claimed, bno);
 	printk(KERN_WARNING "bitmap_free_block ok: %ld -> %ld\n", real_bno, bno);
 }
+
+int bitmap_block_shared(struct super_block *sb, long real_bno) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *ref_bh;
+	unsigned char *ref;
+
+	ref = bitmap_ref(sb, real_bno - bitmap_data_start(sbi), &ref_bh);
+	return ref && *ref;
+}
+
+/*
+ * Adds an owner to a data block. Fails once the refcount byte is
+ * saturated, or when the image was made without a refcount table.
+ */
+int bitmap_get_block(struct super_block *sb, long real_bno) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct buffer_head *ref_bh;
+	unsigned char *ref;
+	int err = 0;
+
+	ref = bitmap_ref(sb, real_bno - bitmap_data_start(sbi), &ref_bh);
+	spin_lock(&sbi->s_ref_lock);
+	if (!ref)
+		err = -EOPNOTSUPP;
+	else if (*ref == SIMPLEFS_REF_MAX)
+		err = -EMLINK;
+	else
+		(*ref)++;
+	spin_unlock(&sbi->s_ref_lock);
+	if (!err)
+		mark_buffer_dirty(ref_bh);
+	return err;
+}
@@ -0,0 +1,141 @@
+package main
+
+// Finds the most fragmented files on a mounted simplefs and moves each
+// of them into one contiguous run of blocks with SIMPLEFS_IOC_DEFRAG.
+// Fragmentation is the number of extents FIBMAP reports, so this has
+// to run as root. Compressed files don't answer FIBMAP and are left
+// alone. The kernel puts each file in the hot or the cold region of
+// the device by its access heat, which -dry shows as well.
+
+import (
+	"os"
+	"fmt"
+	"flag"
+	"sort"
+	"syscall"
+	"unsafe"
+	"path/filepath"
+)
+
+const fibmap = 1
+const simplefs_ioc_defrag = 0x7301 // _IO('s', 1)
+const simplefs_ioc_getheat = 0x800c7302 // _IOR('s', 2, struct simplefs_heat)
+
+type simplefs_heat struct {
+	reads uint32
+	writes uint32
+	hot uint32
+}
+
+type frag_file struct {
+	path string
+	extents int
+}
+
+func ioctl(f *os.File, cmd uintptr, arg uintptr) (err error) {
+	_, _, e := syscall.Syscall(syscall.SYS_IOCTL, f.Fd(), cmd, arg)
+	if e != 0 {
+		err = e
+	}
+	return
+}
+
+func count_extents(f *os.File, size int64) (extents int, err error) {
+	var last int32 = -2
+	for i := int64(0); i < (size + 511) / 512; i++ {
+		blk := int32(i)
+		if err = ioctl(f, fibmap, uintptr(unsafe.Pointer(&blk))); err != nil {
+			return
+		}
+		if blk == 0 {
+			continue
+		}
+		if blk != last + 1 {
+			extents++
+		}
+		last = blk
+	}
+	return
+}
+
+func file_extents(path string, size int64) (extents int, err error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return
+	}
+	defer f.Close()
+	return count_extents(f, size)
+}
+
+func file_heat(path string) (heat simplefs_heat, err error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return
+	}
+	defer f.Close()
+	err = ioctl(f, simplefs_ioc_getheat, uintptr(unsafe.Pointer(&heat)))
+	return
+}
+
+func defrag(path string) (err error) {
+	f, err := os.OpenFile(path, os.O_RDWR, 0)
+	if err != nil {
+		return
+	}
+	defer f.Close()
+	return ioctl(f, simplefs_ioc_defrag, 0)
+}
+
+func main() {
+	max_files := flag.Int("n", 10, "defragment at most this many files")
+	min_extents := flag.Int("min", 2, "skip files with fewer extents")
+	dry_run := flag.Bool("dry", false, "only report the most fragmented files")
+	flag.Parse()
+	if len(flag.Args()) != 1 {
+		fmt.Println("Usage: defrag [-n files] [-min extents] [-dry] mount_point")
+		return
+	}
+
+	var files []frag_file
+	filepath.Walk(flag.Args()[0], func(path string, info os.FileInfo, err error) error {
+		if err != nil || !info.Mode().IsRegular() {
+			return nil
+		}
+		extents, err := file_extents(path, info.Size())
+		if err != nil {
+			fmt.Println(path, err)
+			return nil
+		}
+		if extents >= *min_extents {
+			files = append(files, frag_file{path, extents})
+		}
+		return nil
+	})
+	sort.Slice(files, func(i, j int) bool {
+		return files[i].extents > files[j].extents
+	})
+	if len(files) > *max_files {
+		files = files[:*max_files]
+	}
+
+	for _, ff := range files {
+		if *dry_run {
+			heat, _ := file_heat(ff.path)
+			fmt.Printf("%s: %d extents, %d reads %d writes hot:%d\n", ff.path, ff.extents,
+				heat.reads, heat.writes, heat.hot)
+			continue
+		}
+		if err := defrag(ff.path); err != nil {
+			fmt.Printf("%s: %d extents: %v\n", ff.path, ff.extents, err)
+			continue
+		}
+		info, err := os.Stat(ff.path)
+		if err != nil {
+			fmt.Println(ff.path, err)
+			continue
+		}
+		after, _ := file_extents(ff.path, info.Size())
+		fmt.Printf("%s: %d -> %d extents\n", ff.path, ff.extents, after)
+	}
+	return
+}
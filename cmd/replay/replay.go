@@ -0,0 +1,284 @@
+package main
+
+// Replays a trace recorded by trace.sh against a mounted filesystem,
+// normally a fresh simplefs image, and reports the latency of each
+// kind of operation. Inodes are named by the lookups, creates and
+// mkdirs in the trace; operations on inodes the trace never named
+// (files opened before tracing started) are skipped and counted.
+// Everything is replayed from one thread in trace order.
+
+import (
+	"os"
+	"io"
+	"fmt"
+	"flag"
+	"sort"
+	"time"
+	"bufio"
+	"regexp"
+	"strconv"
+	"strings"
+	"syscall"
+	"path/filepath"
+)
+
+const root_ino = 0
+
+type trace_event struct {
+	ts float64
+	op string
+	fields map[string]int64
+	name string
+}
+
+// "  task-1234  [001] d...  5678.123456: simplefs_write: ino=12 pos=0 len=4096"
+var trace_line = regexp.MustCompile(`^\s*.+-\d+\s+\[\d+\]\s+(?:\S+\s+)?(\d+\.\d+): simplefs_(\w+): (.*)$`)
+
+func parse_event(line string) (ev trace_event, ok bool) {
+	m := trace_line.FindStringSubmatch(line)
+	if m == nil {
+		return
+	}
+	ev.ts, _ = strconv.ParseFloat(m[1], 64)
+	ev.op = m[2]
+	ev.fields = make(map[string]int64)
+	args := m[3]
+	// the name goes last and may hold anything
+	if i := strings.Index(args, "name="); i >= 0 {
+		ev.name = args[i + len("name="):]
+		args = args[:i]
+	}
+	for _, kv := range strings.Fields(args) {
+		p := strings.SplitN(kv, "=", 2)
+		if len(p) != 2 {
+			continue
+		}
+		v, err := strconv.ParseInt(p[1], 10, 64)
+		if err != nil {
+			return
+		}
+		ev.fields[p[0]] = v
+	}
+	ok = true
+	return
+}
+
+func read_trace(path string) (events []trace_event, err error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return
+	}
+	defer f.Close()
+	scanner := bufio.NewScanner(f)
+	for scanner.Scan() {
+		if ev, ok := parse_event(scanner.Text()); ok {
+			events = append(events, ev)
+		}
+	}
+	err = scanner.Err()
+	return
+}
+
+type replayer struct {
+	paths map[int64]string
+	files map[int64]*os.File
+	buf []byte
+	latency map[string][]time.Duration
+	skipped map[string]int
+	failed map[string]int
+}
+
+func (r *replayer) file(ino int64) (f *os.File, err error) {
+	if f = r.files[ino]; f != nil {
+		return
+	}
+	path, ok := r.paths[ino]
+	if !ok {
+		return nil, os.ErrNotExist
+	}
+	if f, err = os.OpenFile(path, os.O_RDWR, 0); err != nil {
+		return
+	}
+	r.files[ino] = f
+	return
+}
+
+func (r *replayer) forget(ino int64) {
+	if f := r.files[ino]; f != nil {
+		f.Close()
+		delete(r.files, ino)
+	}
+	delete(r.paths, ino)
+}
+
+func (r *replayer) buffer(n int64) []byte {
+	if int64(len(r.buf)) < n {
+		r.buf = make([]byte, n)
+	}
+	return r.buf[:n]
+}
+
+// runs one event, ran is false when it can't be replayed
+func (r *replayer) run(ev trace_event) (ran bool, err error) {
+	ino := ev.fields["ino"]
+	var path string
+	if ev.name != "" {
+		dir, ok := r.paths[ev.fields["dir"]]
+		if !ok {
+			return
+		}
+		path = filepath.Join(dir, ev.name)
+	}
+
+	var f *os.File
+	switch ev.op {
+	case "read", "write", "fsync":
+		if f, err = r.file(ino); err != nil {
+			return false, nil
+		}
+	case "readdir":
+		if _, ok := r.paths[ino]; !ok {
+			return
+		}
+	}
+
+	ran = true
+	switch ev.op {
+	case "lookup":
+		_, err = os.Lstat(path)
+		if ino >= 0 {
+			r.paths[ino] = path
+		}
+		if os.IsNotExist(err) {
+			err = nil
+		}
+	case "create":
+		r.forget(ino)
+		if f, err = os.OpenFile(path, os.O_RDWR | os.O_CREATE | os.O_TRUNC, 0644); err == nil {
+			r.paths[ino], r.files[ino] = path, f
+		}
+	case "mkdir":
+		if err = os.Mkdir(path, 0755); err == nil {
+			r.paths[ino] = path
+		}
+	case "unlink":
+		err = os.Remove(path)
+		r.forget(ino)
+	case "read":
+		_, err = f.ReadAt(r.buffer(ev.fields["len"]), ev.fields["pos"])
+		if err == io.EOF {
+			err = nil
+		}
+	case "write":
+		_, err = f.WriteAt(r.buffer(ev.fields["len"]), ev.fields["pos"])
+	case "readdir":
+		var d *os.File
+		if d, err = os.Open(r.paths[ino]); err == nil {
+			_, err = d.Readdirnames(-1)
+			d.Close()
+		}
+	case "fsync":
+		if ev.fields["datasync"] != 0 {
+			err = syscall.Fdatasync(int(f.Fd()))
+		} else {
+			err = f.Sync()
+		}
+	default:
+		ran = false
+	}
+	return
+}
+
+func percentile(sorted []time.Duration, p float64) time.Duration {
+	i := int(float64(len(sorted)) * p / 100)
+	if i >= len(sorted) {
+		i = len(sorted) - 1
+	}
+	return sorted[i]
+}
+
+func (r *replayer) report() {
+	var ops []string
+	for op := range r.latency {
+		ops = append(ops, op)
+	}
+	for op := range r.skipped {
+		if r.latency[op] == nil {
+			ops = append(ops, op)
+		}
+	}
+	sort.Strings(ops)
+	fmt.Printf("%-8s %8s %10s %10s %10s %10s %8s %8s\n",
+		"op", "count", "p50", "p90", "p99", "max", "failed", "skipped")
+	for _, op := range ops {
+		l := r.latency[op]
+		sort.Slice(l, func(i, j int) bool { return l[i] < l[j] })
+		if len(l) == 0 {
+			fmt.Printf("%-8s %8d %10s %10s %10s %10s %8d %8d\n", op, 0, "-", "-", "-", "-",
+				r.failed[op], r.skipped[op])
+			continue
+		}
+		fmt.Printf("%-8s %8d %10v %10v %10v %10v %8d %8d\n", op, len(l),
+			percentile(l, 50), percentile(l, 90), percentile(l, 99), l[len(l) - 1],
+			r.failed[op], r.skipped[op])
+	}
+}
+
+func main() {
+	timing := flag.String("timing", "max", "orig to keep the recorded gaps between operations, max to run them back to back")
+	verbose := flag.Bool("v", false, "print operations that fail")
+	flag.Parse()
+	if len(flag.Args()) != 2 || (*timing != "orig" && *timing != "max") {
+		fmt.Println("Usage: replay [-timing orig|max] [-v] trace mount_point")
+		return
+	}
+	events, err := read_trace(flag.Args()[0])
+	if err != nil {
+		fmt.Println(err)
+		return
+	}
+	if len(events) == 0 {
+		fmt.Println("no simplefs events in", flag.Args()[0])
+		return
+	}
+
+	r := &replayer{
+		paths: map[int64]string{root_ino: flag.Args()[1]},
+		files: make(map[int64]*os.File),
+		latency: make(map[string][]time.Duration),
+		skipped: make(map[string]int),
+		failed: make(map[string]int),
+	}
+	start := time.Now()
+	for _, ev := range events {
+		// one listing per pass over a directory
+		if ev.op == "readdir" && ev.fields["pos"] != 0 {
+			continue
+		}
+		if *timing == "orig" {
+			at := start.Add(time.Duration((ev.ts - events[0].ts) * float64(time.Second)))
+			time.Sleep(time.Until(at))
+		}
+		t := time.Now()
+		ran, err := r.run(ev)
+		d := time.Since(t)
+		if !ran {
+			r.skipped[ev.op]++
+			continue
+		}
+		if err != nil {
+			r.failed[ev.op]++
+			if *verbose {
+				fmt.Println(ev.op, err)
+			}
+			continue
+		}
+		r.latency[ev.op] = append(r.latency[ev.op], d)
+	}
+	for ino := range r.files {
+		r.forget(ino)
+	}
+	fmt.Printf("%d events in %v\n", len(events), time.Since(start))
+	r.report()
+	return
+}
@@ -0,0 +1,397 @@
+/*
+ * linux/fs/sfs/compress.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/highmem.h>
+#include <linux/lzo.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/writeback.h>
+#include "simplefs.h"
+
+/*
+ * A compressed file stores each page as one cluster in the i_data slots
+ * [index * SIMPLEFS_BLOCKS_PER_PAGE, ...). A cluster that would not save
+ * a block is stored raw. A compressed cluster uses fewer blocks than the
+ * page needs raw, so there is always a slot left after its blocks for
+ * SIMPLEFS_COMPR_MARK, which tells the two apart. Its data starts with
+ * this header. Unused slots are left 0.
+ */
+struct simplefs_compr_header {
+	__le32 c_len;
+};
+#define SIMPLEFS_COMPR_HDR sizeof(struct simplefs_compr_header)
+
+static unsigned page_bytes(struct inode *inode, struct page *page) {
+	loff_t size = i_size_read(inode);
+
+	if (page_offset(page) >= size)
+		return 0;
+	return min_t(loff_t, size - page_offset(page), PAGE_CACHE_SIZE);
+}
+
+static unsigned cluster_slots(struct page *page) {
+	unsigned first = page->index * SIMPLEFS_BLOCKS_PER_PAGE;
+
+	if (first >= SIMPLEFS_BLOCKS_PER_INODE)
+		return 0;
+	return min_t(unsigned, SIMPLEFS_BLOCKS_PER_PAGE, SIMPLEFS_BLOCKS_PER_INODE - first);
+}
+
+/*
+ * Read blocks into buf, starting all the reads before waiting on any,
+ * so a cluster striped over several devices is read from all of them
+ * at once.
+ */
+static int read_cluster(struct super_block *sb, __le32 *slots, int used, char *buf) {
+	struct buffer_head *bh;
+	int i;
+
+	for (i = 0; i < used; i++)
+		simplefs_breadahead(sb, slots[i]);
+	for (i = 0; i < used; i++) {
+		if (!(bh = simplefs_bread(sb, slots[i])))
+			return -EIO;
+		memcpy(buf + (i << SIMPLEFS_BLOCKBITS), bh->b_data, SIMPLEFS_BLOCKSIZE);
+		brelse(bh);
+	}
+	return 0;
+}
+
+/*
+ * Fill a locked page from its cluster and mark it uptodate.
+ */
+static int simplefs_compr_fill_page(struct inode *inode, struct page *page) {
+	struct simplefs_compr_header *hdr;
+	struct simplefs_inode *raw_inode;
+	struct buffer_head *bh;
+	unsigned bytes, need, used, first;
+	size_t out_len = PAGE_CACHE_SIZE;
+	char *kaddr, *cbuf = NULL;
+	int err = 0;
+
+	bytes = page_bytes(inode, page);
+	need = (bytes + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+	kaddr = kmap(page);
+	if (!bytes)
+		goto zero;
+	if (!(raw_inode = simplefs_iget_raw(inode->i_sb, inode->i_ino, &bh))) {
+		err = -EIO;
+		goto out;
+	}
+	first = page->index * SIMPLEFS_BLOCKS_PER_PAGE;
+	for (used = 0; used < cluster_slots(page) && slot_mapped(raw_inode->i_data[first + used]); used++)
+		;
+
+	if (!used) {
+		/* never written back, read it as a hole */
+		bytes = 0;
+	} else if (used == cluster_slots(page) || raw_inode->i_data[first + used] != SIMPLEFS_COMPR_MARK) {
+		/* the file may have grown since, the rest is zeroes */
+		used = min(used, need);
+		err = read_cluster(inode->i_sb, raw_inode->i_data + first, used, kaddr);
+		bytes = used << SIMPLEFS_BLOCKBITS;
+	} else if (!(cbuf = kmalloc(used << SIMPLEFS_BLOCKBITS, GFP_NOFS))) {
+		err = -ENOMEM;
+	} else if (!(err = read_cluster(inode->i_sb, raw_inode->i_data + first, used, cbuf))) {
+		hdr = (struct simplefs_compr_header *)cbuf;
+		if (hdr->c_len > (used << SIMPLEFS_BLOCKBITS) - SIMPLEFS_COMPR_HDR ||
+		    lzo1x_decompress_safe(cbuf + SIMPLEFS_COMPR_HDR, hdr->c_len,
+					  kaddr, &out_len) != LZO_E_OK ||
+		    out_len > bytes) {
+			printk(KERN_ERR "simplefs: corrupt cluster %lu of inode %ld\n",
+			       page->index, inode->i_ino);
+			err = -EIO;
+		}
+		bytes = out_len;
+	}
+	kfree(cbuf);
+	brelse(bh);
+	if (err)
+		goto out;
+ zero:
+	memset(kaddr + bytes, 0, PAGE_CACHE_SIZE - bytes);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+ out:
+	kunmap(page);
+	return err;
+}
+
+static int simplefs_compr_readpage(struct file *file, struct page *page) {
+	int err;
+
+	if ((err = simplefs_compr_fill_page(page->mapping->host, page)))
+		SetPageError(page);
+	unlock_page(page);
+	return err;
+}
+
+/*
+ * The LZO work memory of every cpu, set up by the first compression
+ * on the filesystem. NULL when that fails.
+ */
+static void **simplefs_compr_wrkmem(struct simplefs_super_info *sbi) {
+	void **wrkmem;
+	int cpu;
+
+	if ((wrkmem = ACCESS_ONCE(sbi->s_compr_wrkmem))) {
+		smp_rmb();
+		return wrkmem;
+	}
+	mutex_lock(&sbi->s_compr_mutex);
+	if (!(wrkmem = sbi->s_compr_wrkmem) && (wrkmem = alloc_percpu(void *))) {
+		for_each_possible_cpu(cpu) {
+			if (!(*per_cpu_ptr(wrkmem, cpu) = vmalloc(LZO1X_1_MEM_COMPRESS)))
+				break;
+		}
+		if (cpu < nr_cpu_ids) {
+			for_each_possible_cpu(cpu)
+				vfree(*per_cpu_ptr(wrkmem, cpu));
+			free_percpu(wrkmem);
+			wrkmem = NULL;
+		} else {
+			smp_wmb();
+			sbi->s_compr_wrkmem = wrkmem;
+		}
+	}
+	mutex_unlock(&sbi->s_compr_mutex);
+	return wrkmem;
+}
+
+/*
+ * Compress the page into cbuf, which holds SIMPLEFS_COMPR_BUF bytes.
+ * Returns the number of blocks the cluster needs, header included, or
+ * 0 when it is not worth it.
+ */
+#define SIMPLEFS_COMPR_BUF (SIMPLEFS_COMPR_HDR + lzo1x_worst_compress(PAGE_CACHE_SIZE))
+
+static unsigned compress_page(struct simplefs_super_info *sbi, char *kaddr,
+			      unsigned bytes, unsigned need, char *cbuf) {
+	struct simplefs_compr_header *hdr = (struct simplefs_compr_header *)cbuf;
+	void **wrkmem;
+	size_t c_len;
+	unsigned used;
+	int ret;
+
+	if (!(wrkmem = simplefs_compr_wrkmem(sbi)))
+		return 0;
+	ret = lzo1x_1_compress(kaddr, bytes, cbuf + SIMPLEFS_COMPR_HDR, &c_len,
+			       *per_cpu_ptr(wrkmem, get_cpu()));
+	put_cpu();
+	if (ret != LZO_E_OK)
+		return 0;
+	hdr->c_len = c_len;
+	used = (SIMPLEFS_COMPR_HDR + c_len + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+	return used < need ? used : 0;
+}
+
+/* the blocks of one cluster in flight */
+struct simplefs_compr_io {
+	atomic_t pending;
+	int err;
+	struct page *page;
+};
+
+static void simplefs_compr_io_put(struct simplefs_compr_io *io) {
+	if (!atomic_dec_and_test(&io->pending))
+		return;
+	if (io->err) {
+		printk(KERN_ERR "simplefs: can't write cluster %lu of inode %ld\n",
+		       io->page->index, io->page->mapping->host->i_ino);
+		SetPageError(io->page);
+		mapping_set_error(io->page->mapping, io->err);
+	}
+	end_page_writeback(io->page);
+	kfree(io);
+}
+
+static void simplefs_compr_end_io(struct buffer_head *bh, int uptodate) {
+	struct simplefs_compr_io *io = bh->b_private;
+
+	if (uptodate) {
+		set_buffer_uptodate(bh);
+	} else {
+		clear_buffer_uptodate(bh);
+		io->err = -EIO;
+	}
+	bh->b_private = NULL;
+	unlock_buffer(bh);
+	put_bh(bh);
+	simplefs_compr_io_put(io);
+}
+
+/*
+ * Write the page out as a cluster through the buffer cache. Blocks are
+ * reallocated as the cluster grows or shrinks, and shared ones are
+ * replaced instead of overwritten. The blocks may be on different
+ * devices, so they can't be tied to the inode with
+ * mark_buffer_dirty_inode. All of them are submitted together, and the
+ * page stays under writeback until the last one completes.
+ */
+static int simplefs_compr_writepage(struct page *page, struct writeback_control *wbc) {
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+	struct simplefs_inode *raw_inode;
+	struct simplefs_compr_io *io;
+	struct buffer_head *bh, *raw_bh, *bhs[SIMPLEFS_BLOCKS_PER_INODE];
+	unsigned i, nbh = 0, bytes, need, used, first;
+	char *kaddr, *src, *cbuf;
+	long bno;
+	int err = 0;
+
+	if (!(bytes = page_bytes(inode, page))) {
+		/* truncated */
+		unlock_page(page);
+		return 0;
+	}
+	need = (bytes + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+	first = page->index * SIMPLEFS_BLOCKS_PER_PAGE;
+	if (!(io = kmalloc(sizeof(*io), GFP_NOFS))) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return -ENOMEM;
+	}
+	if (!(raw_inode = simplefs_iget_raw(sb, inode->i_ino, &raw_bh))) {
+		kfree(io);
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return -EIO;
+	}
+
+	kaddr = kmap(page);
+	/* stored raw when there is no memory to compress it */
+	cbuf = kmalloc(SIMPLEFS_COMPR_BUF, GFP_NOFS);
+	if (cbuf && (used = compress_page(sbi, kaddr, bytes, need, cbuf))) {
+		src = cbuf;
+	} else {
+		used = need;
+		src = kaddr;
+	}
+
+	mutex_lock(&si->i_compr_mutex);
+	for (i = 0; i < cluster_slots(page); i++) {
+		bno = raw_inode->i_data[first + i];
+		if (!slot_mapped(bno)) {
+			bno = 0;
+		} else if (i >= used || bitmap_block_shared(sb, bno)) {
+			bitmap_free_block(sb, bno);
+			bno = 0;
+		}
+		raw_inode->i_data[first + i] = bno;
+		if (i >= used) {
+			if (i == used && src != kaddr)
+				raw_inode->i_data[first + i] = SIMPLEFS_COMPR_MARK;
+			continue;
+		}
+		if (!bno) {
+			if ((bno = simplefs_reserve_block(sb, simplefs_alloc_goal(inode))) < 0) {
+				err = -ENOSPC;
+				break;
+			}
+			raw_inode->i_data[first + i] = bno;
+		}
+		if (!(bh = simplefs_getblk(sb, bno))) {
+			err = -EIO;
+			break;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, src + (i << SIMPLEFS_BLOCKBITS), SIMPLEFS_BLOCKSIZE);
+		set_buffer_uptodate(bh);
+		clear_buffer_dirty(bh);
+		bhs[nbh++] = bh;
+	}
+	mutex_unlock(&si->i_compr_mutex);
+	kunmap(page);
+	kfree(cbuf);
+	mark_buffer_dirty(raw_bh);
+	brelse(raw_bh);
+	mark_inode_dirty(inode);
+
+	if (err) {
+		/* i_data has them, so they go out with the block device */
+		for (i = 0; i < nbh; i++) {
+			mark_buffer_dirty(bhs[i]);
+			unlock_buffer(bhs[i]);
+			brelse(bhs[i]);
+		}
+		kfree(io);
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return err;
+	}
+	/* one extra count so the page can't finish before all are submitted */
+	atomic_set(&io->pending, nbh + 1);
+	io->err = 0;
+	io->page = page;
+	set_page_writeback(page);
+	unlock_page(page);
+	for (i = 0; i < nbh; i++) {
+		bhs[i]->b_private = io;
+		bhs[i]->b_end_io = simplefs_compr_end_io;
+		submit_bh(WRITE, bhs[i]);
+	}
+	simplefs_compr_io_put(io);
+	return 0;
+}
+
+static int simplefs_compr_write_begin(struct file *file, struct address_space *mapping,
+				      loff_t pos, unsigned len, unsigned flags,
+				      struct page **pagep, void **fsdata) {
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+	int err;
+
+	if (pos + len > SIMPLEFS_BLOCKS_PER_INODE * SIMPLEFS_BLOCKSIZE)
+		return -EFBIG;
+	if (!(page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT, flags)))
+		return -ENOMEM;
+	*pagep = page;
+	if (PageUptodate(page) || (from == 0 && len == PAGE_CACHE_SIZE))
+		return 0;
+	if ((err = simplefs_compr_fill_page(mapping->host, page))) {
+		unlock_page(page);
+		page_cache_release(page);
+		*pagep = NULL;
+	}
+	return err;
+}
+
+static int simplefs_compr_write_end(struct file *file, struct address_space *mapping,
+				    loff_t pos, unsigned len, unsigned copied,
+				    struct page *page, void *fsdata) {
+	struct inode *inode = mapping->host;
+	loff_t old_size = inode->i_size;
+
+	copied = simple_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (inode->i_size != old_size)
+		mark_inode_dirty(inode);
+	return copied;
+}
+
+const struct address_space_operations simplefs_compr_aops = {
+	.readpage = simplefs_compr_readpage,
+	.writepage = simplefs_compr_writepage,
+	.sync_page = block_sync_page,
+	.write_begin = simplefs_compr_write_begin,
+	.write_end = simplefs_compr_write_end,
+	.set_page_dirty = __set_page_dirty_nobuffers,
+};
+
+void simplefs_compr_free(struct simplefs_super_info *sbi) {
+	int cpu;
+
+	if (!sbi->s_compr_wrkmem)
+		return;
+	for_each_possible_cpu(cpu)
+		vfree(*per_cpu_ptr(sbi->s_compr_wrkmem, cpu));
+	free_percpu(sbi->s_compr_wrkmem);
+	sbi->s_compr_wrkmem = NULL;
+}
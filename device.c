@@ -0,0 +1,218 @@
+/*
+ * linux/fs/sfs/device.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include "simplefs.h"
+
+/*
+ * A filesystem may span several devices. Block numbers stored on disk
+ * are logical: everything below the data area lives on device 0, as on
+ * a single device, and data block L (counted from the data area) is in
+ * stripe L / s_stripe_blknr, which goes to device stripe % nr_devices.
+ * Device 0 keeps its share of the data where the data area starts, the
+ * other members right after their header block.
+ */
+
+static unsigned long simplefs_member_blocks(struct simplefs_super_info *sbi) {
+	unsigned long stripe = sbi->raw_super.s_stripe_blknr;
+	unsigned long stripes = DIV_ROUND_UP(sbi->raw_super.s_block_blknr, stripe);
+
+	return DIV_ROUND_UP(stripes, sbi->s_nr_devices) * stripe;
+}
+
+static int simplefs_check_size(struct block_device *bdev, sector_t need) {
+	if ((i_size_read(bdev->bd_inode) >> SIMPLEFS_BLOCKBITS) >= need)
+		return 0;
+	printk(KERN_ERR "Simplefs: device %s is too small, needs %llu blocks\n",
+	       bdev->bd_disk->disk_name, (unsigned long long)need);
+	return -EINVAL;
+}
+
+static int simplefs_open_member(struct super_block *sb, const char *path, int index) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_member *member;
+	struct block_device *bdev;
+	struct buffer_head *bh;
+	int err = -EINVAL;
+
+	bdev = open_bdev_exclusive(path, sbi->s_dev_mode, sb);
+	if (IS_ERR(bdev)) {
+		printk(KERN_ERR "Simplefs: can't open device %s\n", path);
+		return PTR_ERR(bdev);
+	}
+	if (set_blocksize(bdev, SIMPLEFS_BLOCKSIZE))
+		goto failed;
+	if (!(bh = __bread(bdev, SIMPLEFS_MEMBER_BNO, SIMPLEFS_BLOCKSIZE))) {
+		err = -EIO;
+		goto failed;
+	}
+	member = (struct simplefs_member *)bh->b_data;
+	if (member->m_magic != SIMPLEFS_MEMBER_MAGIC || member->m_fsid != sbi->raw_super.s_fsid ||
+	    member->m_index != index) {
+		printk(KERN_ERR "Simplefs: %s is not device %d of this filesystem\n", path, index);
+		brelse(bh);
+		goto failed;
+	}
+	brelse(bh);
+	if ((err = simplefs_check_size(bdev, SIMPLEFS_MEMBER_BNO + 1 + simplefs_member_blocks(sbi))))
+		goto failed;
+	sbi->s_devs[index] = bdev;
+	printk(KERN_INFO "simplefs_open_member: %s %d\n", path, index);
+	return 0;
+
+ failed:
+	close_bdev_exclusive(bdev, sbi->s_dev_mode);
+	return err;
+}
+
+/*
+ * Open the extra devices, given by the devices= mount option as a
+ * colon separated list in member order.
+ */
+int simplefs_open_devices(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_super *rsb = &sbi->raw_super;
+	char *paths, *p, *path;
+	int i, err = 0;
+
+	sbi->s_devs[0] = sb->s_bdev;
+	sbi->s_nr_devices = rsb->s_nr_devices ? rsb->s_nr_devices : 1;
+	sbi->s_dev_mode = FMODE_READ;
+	if (!(sb->s_flags & MS_RDONLY))
+		sbi->s_dev_mode |= FMODE_WRITE;
+	if (sbi->s_nr_devices == 1)
+		return 0;
+	if (sbi->s_nr_devices > SIMPLEFS_MAX_DEVICES || !rsb->s_stripe_blknr) {
+		printk(KERN_ERR "Simplefs: bad device count %d or stripe size %d\n",
+		       sbi->s_nr_devices, rsb->s_stripe_blknr);
+		return -EINVAL;
+	}
+	if ((err = simplefs_check_size(sb->s_bdev, bitmap_data_start(sbi) + simplefs_member_blocks(sbi))))
+		return err;
+	if (!sbi->s_devices || !(p = paths = kstrdup(sbi->s_devices, GFP_KERNEL))) {
+		printk(KERN_ERR "Simplefs: filesystem has %d devices, pass the others with devices=\n",
+		       sbi->s_nr_devices);
+		return -EINVAL;
+	}
+	for (i = 1; i < sbi->s_nr_devices; i++) {
+		if (!(path = strsep(&p, ":")) || !*path) {
+			printk(KERN_ERR "Simplefs: device %d of %d missing\n", i, sbi->s_nr_devices);
+			err = -EINVAL;
+			break;
+		}
+		if ((err = simplefs_open_member(sb, path, i)))
+			break;
+	}
+	kfree(paths);
+	if (err)
+		simplefs_close_devices(sb);
+	return err;
+}
+
+void simplefs_close_devices(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	int i;
+
+	for (i = 1; i < SIMPLEFS_MAX_DEVICES; i++) {
+		if (!sbi->s_devs[i])
+			continue;
+		sync_blockdev(sbi->s_devs[i]);
+		close_bdev_exclusive(sbi->s_devs[i], sbi->s_dev_mode);
+		sbi->s_devs[i] = NULL;
+	}
+}
+
+/*
+ * Map a logical block to the device holding it and the block there.
+ */
+struct block_device *simplefs_map_block(struct super_block *sb, long bno, sector_t *pblk) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	unsigned long stripe, dev, off, start = bitmap_data_start(sbi);
+	unsigned long unit = sbi->raw_super.s_stripe_blknr;
+
+	if (sbi->s_nr_devices == 1 || bno < start) {
+		*pblk = bno;
+		return sb->s_bdev;
+	}
+	bno -= start;
+	stripe = bno / unit;
+	dev = stripe % sbi->s_nr_devices;
+	off = stripe / sbi->s_nr_devices * unit + bno % unit;
+	*pblk = dev ? SIMPLEFS_MEMBER_BNO + 1 + off : start + off;
+	return sbi->s_devs[dev];
+}
+
+/* the reverse of simplefs_map_block, for buffers of mapped pages */
+long simplefs_logical_block(struct super_block *sb, struct block_device *bdev, sector_t pblk) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	unsigned long dev, off, start = bitmap_data_start(sbi);
+	unsigned long unit = sbi->raw_super.s_stripe_blknr;
+
+	if (sbi->s_nr_devices == 1)
+		return pblk;
+	for (dev = 0; dev < sbi->s_nr_devices && sbi->s_devs[dev] != bdev; dev++)
+		;
+	if (dev == sbi->s_nr_devices)
+		return -1;
+	if (!dev && pblk < start)
+		return pblk;
+	off = pblk - (dev ? SIMPLEFS_MEMBER_BNO + 1 : start);
+	return start + (off / unit * sbi->s_nr_devices + dev) * unit + off % unit;
+}
+
+void simplefs_map_bh(struct buffer_head *bh, struct super_block *sb, long bno) {
+	sector_t pblk;
+	struct block_device *bdev = simplefs_map_block(sb, bno, &pblk);
+
+	map_bh(bh, sb, pblk);
+	bh->b_bdev = bdev;
+}
+
+struct buffer_head *simplefs_bread(struct super_block *sb, long bno) {
+	sector_t pblk;
+	struct block_device *bdev = simplefs_map_block(sb, bno, &pblk);
+
+	return __bread(bdev, pblk, SIMPLEFS_BLOCKSIZE);
+}
+
+struct buffer_head *simplefs_getblk(struct super_block *sb, long bno) {
+	sector_t pblk;
+	struct block_device *bdev = simplefs_map_block(sb, bno, &pblk);
+
+	return __getblk(bdev, pblk, SIMPLEFS_BLOCKSIZE);
+}
+
+/*
+ * Read a data block from the disk even when the block device's cache
+ * has it. File data is written through the page cache, so a copy
+ * cached here can be older than the block.
+ */
+struct buffer_head *simplefs_bread_disk(struct super_block *sb, long bno) {
+	struct buffer_head *bh = simplefs_getblk(sb, bno);
+
+	if (!bh)
+		return NULL;
+	lock_buffer(bh);
+	if (!buffer_dirty(bh))
+		clear_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ll_rw_block(READ, 1, &bh);
+	wait_on_buffer(bh);
+	if (buffer_uptodate(bh))
+		return bh;
+	brelse(bh);
+	return NULL;
+}
+
+void simplefs_breadahead(struct super_block *sb, long bno) {
+	sector_t pblk;
+	struct block_device *bdev = simplefs_map_block(sb, bno, &pblk);
+
+	__breadahead(bdev, pblk, SIMPLEFS_BLOCKSIZE);
+}
@@ -8,6 +8,7 @@
 #include <linux/buffer_head.h>
 #include <asm-generic/errno-base.h>
 #include "simplefs.h"
+#include "trace.h"
 
 static int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir) {
 	unsigned long pos = filp->f_pos;
@@ -17,6 +18,7 @@ static int simplefs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	unsigned long npages = inode_pages(inode);
 
 	printk(KERN_INFO "simplefs_readdir\n");
+	trace_simplefs_readdir(inode, pos);
 	pos = (pos + SIMPLEFS_DENTRY_SIZE - 1) & ~(SIMPLEFS_DENTRY_SIZE - 1);
 	if (pos >= inode->i_size)
 		goto done;
@@ -58,7 +60,8 @@ const struct file_operations simplefs_dir_operations = {
 	.llseek = generic_file_llseek,
 	.read = generic_read_dir,
 	.readdir = simplefs_readdir,
-	.fsync = simple_fsync,
+	.fsync = simplefs_fsync,
+	.unlocked_ioctl = simplefs_ioctl,
 };
 
 
@@ -107,6 +110,7 @@ static struct dentry *simplefs_lookup(struct inode *dir, struct dentry *dentry,
 		printk(KERN_INFO "simplefs_lookup: dentry %d", dentry->d_count.counter);
 		printk(KERN_INFO "simplefs_lookup: inode %ld %ld %d %d", inode->i_ino, inode->i_state, inode->i_count.counter, inode->i_nlink);
 	}
+	trace_simplefs_lookup(dir, dentry, inode ? (long)inode->i_ino : -1);
 
 	return d_splice_alias(inode, dentry);
 }
@@ -116,22 +120,24 @@ static int simplefs_create(struct inode *dir, struct dentry *dentry, int mode, s
 	long ino;
 	int err = 0;
 
-	ino = bitmap_alloc_inode(dir->i_sb);
+	ino = simplefs_reserve_inode(dir->i_sb);
 	if (ino < 0)
-		return -EIO;
-	inode = simplefs_iget(dir->i_sb, ino);
-	if (IS_ERR(inode))
-		return -EIO;
+		return ino;
+	if (!(inode = simplefs_inew(dir->i_sb, ino))) {
+		bitmap_free_inode(dir->i_sb, ino);
+		return -ENOMEM;
+	}
 
-	inode->i_state = 0;
 	inode->i_mode = mode | S_IFREG;
+	SIMPLEFS_I(inode)->i_flags = SIMPLEFS_I(dir)->i_flags;
+	simplefs_set_inode_ops(inode);
 	inode->i_nlink = 1;
-	inode->i_size = inode->i_blocks = inode->i_bytes = 0;
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	unlock_new_inode(inode);
 	mark_inode_dirty(inode);
 	err = simplefs_insert_dentry(dentry, inode);
 	if (!err) {
 		//dentry->d_op = &d_op;
+		trace_simplefs_create(dir, dentry, inode->i_ino);
 		d_instantiate(dentry, inode);
 		if (inode) {
 			printk(KERN_INFO "simplefs_create: dentry %d", dentry->d_count.counter);
@@ -173,8 +179,12 @@ static int simplefs_unlink(struct inode *dir, struct dentry *dentry) {
 	err = simplefs_delete_dentry(raw_de, rs_page);
 	if (err)
 		goto out;
+	trace_simplefs_unlink(dir, dentry, inode->i_ino);
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
+	/* freed by delete_inode, or at the next mount if we crash first */
+	if (!inode->i_nlink)
+		simplefs_orphan_add(inode);
 	printk(KERN_INFO "simplefs_unlink %s %d\n", dentry->d_name.name, dentry->d_count.counter);
 	printk(KERN_INFO "simplefs_unlink %d %d \n", inode->i_count.counter, inode->i_nlink);
  out:
@@ -188,28 +198,25 @@ static int simplefs_mkdir(struct inode *dir, struct dentry *dentry, int mode) {
 	int err = 0;
 
 	printk(KERN_INFO "simplefs_mkdir: %s %d\n", dentry->d_name.name, mode);
-	inode_inc_link_count(dir);
-	
-	ino = bitmap_alloc_inode(dir->i_sb);
+	ino = simplefs_reserve_inode(dir->i_sb);
 	if (ino < 0)
-		return -EIO;
-	inode = simplefs_iget(dir->i_sb, ino);
-	if (IS_ERR(inode))
-		return -EIO;
-
-	// set inode operations
-	inode->i_op = &simplefs_file_inode_operations;
-	inode->i_fop = &simplefs_file_operations;
-	inode->i_mapping->a_ops = &simplefs_aops;
+		return ino;
+	if (!(inode = simplefs_inew(dir->i_sb, ino))) {
+		bitmap_free_inode(dir->i_sb, ino);
+		return -ENOMEM;
+	}
+	inode_inc_link_count(dir);
 
 	inode->i_mode = mode | S_IFDIR;
+	SIMPLEFS_I(inode)->i_flags = SIMPLEFS_I(dir)->i_flags;
+	simplefs_set_inode_ops(inode);
 	inode->i_nlink = 2;
-	inode->i_size = inode->i_blocks = inode->i_bytes = 0;
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	unlock_new_inode(inode);
 
 	mark_inode_dirty(inode);
 	err = simplefs_insert_dentry(dentry, inode);
 	if (!err) {
+		trace_simplefs_mkdir(dir, dentry, inode->i_ino);
 		d_instantiate(dentry, inode);
 		return 0;
 	}
@@ -0,0 +1,311 @@
+/*
+ * linux/fs/sfs/dirhash.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include "simplefs.h"
+
+/*
+ * In-memory name index of a directory, built by the first lookup that
+ * would have to scan it. It maps a name to the position of its dentry
+ * in the directory file. It is only read or changed under the
+ * directory's i_mutex, which the shrinker takes with trylock before
+ * dropping a table.
+ */
+struct simplefs_dirhash_entry {
+	struct hlist_node d_hash;
+	loff_t d_pos;
+	unsigned char d_len;
+	char d_name[SIMPLEFS_NAME_LEN];
+};
+
+struct simplefs_dirhash {
+	struct list_head h_lru;
+	struct inode *h_dir;
+	unsigned long h_count;
+	unsigned int h_bits;
+	struct hlist_head *h_table;
+};
+
+#define DIRHASH_MIN_BITS 4
+#define DIRHASH_MAX_BITS 16
+
+static LIST_HEAD(dirhash_lru);
+static DEFINE_SPINLOCK(dirhash_lock);
+static unsigned long dirhash_entries;
+
+static struct hlist_head *dirhash_bucket(struct simplefs_dirhash *h,
+					 const char *name, int len) {
+	return &h->h_table[hash_long(full_name_hash(name, len), h->h_bits)];
+}
+
+static struct hlist_head *dirhash_alloc_table(unsigned int bits) {
+	struct hlist_head *table;
+	int i;
+
+	if (!(table = kmalloc(sizeof(*table) << bits, GFP_NOFS)))
+		return NULL;
+	for (i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&table[i]);
+	return table;
+}
+
+/*
+ * Double the bucket count once the chains get long. Failing to grow
+ * only costs speed.
+ */
+static void dirhash_grow(struct simplefs_dirhash *h) {
+	struct simplefs_dirhash_entry *e;
+	struct hlist_node *pos, *n;
+	struct hlist_head *old = h->h_table;
+	int i, old_bits = h->h_bits;
+
+	if (h->h_count <= (2UL << h->h_bits) || h->h_bits >= DIRHASH_MAX_BITS)
+		return;
+	if (!(h->h_table = dirhash_alloc_table(old_bits + 1))) {
+		h->h_table = old;
+		return;
+	}
+	h->h_bits++;
+	for (i = 0; i < (1 << old_bits); i++) {
+		hlist_for_each_entry_safe(e, pos, n, &old[i], d_hash) {
+			hlist_del(&e->d_hash);
+			hlist_add_head(&e->d_hash, dirhash_bucket(h, e->d_name, e->d_len));
+		}
+	}
+	kfree(old);
+}
+
+static int dirhash_insert(struct simplefs_dirhash *h, const char *name, int len, loff_t pos) {
+	struct simplefs_dirhash_entry *e;
+
+	if (!(e = kmalloc(sizeof(*e), GFP_NOFS)))
+		return -ENOMEM;
+	e->d_pos = pos;
+	e->d_len = len;
+	memcpy(e->d_name, name, len);
+	hlist_add_head(&e->d_hash, dirhash_bucket(h, name, len));
+	h->h_count++;
+	spin_lock(&dirhash_lock);
+	dirhash_entries++;
+	spin_unlock(&dirhash_lock);
+	dirhash_grow(h);
+	return 0;
+}
+
+static struct simplefs_dirhash_entry *dirhash_lookup(struct simplefs_dirhash *h,
+						     const char *name, int len) {
+	struct simplefs_dirhash_entry *e;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(e, pos, dirhash_bucket(h, name, len), d_hash) {
+		if (e->d_len == len && !memcmp(e->d_name, name, len))
+			return e;
+	}
+	return NULL;
+}
+
+static unsigned long dirhash_free(struct simplefs_dirhash *h) {
+	struct simplefs_dirhash_entry *e;
+	struct hlist_node *pos, *n;
+	unsigned long count = h->h_count;
+	int i;
+
+	for (i = 0; i < (1 << h->h_bits); i++) {
+		hlist_for_each_entry_safe(e, pos, n, &h->h_table[i], d_hash)
+			kfree(e);
+	}
+	kfree(h->h_table);
+	kfree(h);
+	return count;
+}
+
+void simplefs_dirhash_drop(struct inode *dir) {
+	struct simplefs_inode_info *si = SIMPLEFS_I(dir);
+	struct simplefs_dirhash *h;
+
+	spin_lock(&dirhash_lock);
+	if ((h = si->i_dirhash)) {
+		si->i_dirhash = NULL;
+		list_del(&h->h_lru);
+		dirhash_entries -= h->h_count;
+	}
+	spin_unlock(&dirhash_lock);
+	if (h)
+		dirhash_free(h);
+}
+
+/*
+ * Scan the whole directory once and index every live dentry.
+ */
+static struct simplefs_dirhash *dirhash_build(struct inode *dir) {
+	unsigned long n, npages = inode_pages(dir);
+	struct simplefs_dirhash *h;
+
+	if (!(h = kzalloc(sizeof(*h), GFP_NOFS)))
+		return NULL;
+	h->h_dir = dir;
+	h->h_bits = DIRHASH_MIN_BITS;
+	if (!(h->h_table = dirhash_alloc_table(h->h_bits))) {
+		kfree(h);
+		return NULL;
+	}
+	for (n = 0; n < npages; n++) {
+		char *p, *kaddr, *limit;
+		struct page *page = simplefs_get_page(dir, n);
+		if (IS_ERR(page))
+			goto failed;
+		p = kaddr = (char *)page_address(page);
+		limit = kaddr + inode_last_bytes(dir, n) - SIMPLEFS_DENTRY_SIZE;
+		for ( ; p <= limit; p += SIMPLEFS_DENTRY_SIZE) {
+			struct simplefs_dentry *de = (struct simplefs_dentry *)p;
+			if (de->flags == SIMPLEFS_DENTRY_UNUSED)
+				continue;
+			if (dirhash_insert(h, de->name, strnlen(de->name, SIMPLEFS_NAME_LEN),
+					   page_offset(page) + (p - kaddr))) {
+				simplefs_put_page(page);
+				goto failed;
+			}
+		}
+		simplefs_put_page(page);
+	}
+
+	spin_lock(&dirhash_lock);
+	SIMPLEFS_I(dir)->i_dirhash = h;
+	list_add_tail(&h->h_lru, &dirhash_lru);
+	spin_unlock(&dirhash_lock);
+	return h;
+
+ failed:
+	spin_lock(&dirhash_lock);
+	dirhash_entries -= h->h_count;
+	spin_unlock(&dirhash_lock);
+	dirhash_free(h);
+	return NULL;
+}
+
+/*
+ * Look a name up through the index, building it first if needed.
+ * Returns ERR_PTR(-EAGAIN) when there is no index and the caller has
+ * to scan the directory itself.
+ */
+struct simplefs_dentry *simplefs_dirhash_find(struct inode *dir, struct dentry *dentry,
+					      struct page **rs_page) {
+	struct simplefs_dirhash *h = SIMPLEFS_I(dir)->i_dirhash;
+	struct simplefs_dirhash_entry *e;
+	struct simplefs_dentry *de;
+	struct page *page;
+
+	if (!h && !(h = dirhash_build(dir)))
+		return ERR_PTR(-EAGAIN);
+
+	spin_lock(&dirhash_lock);
+	list_move_tail(&h->h_lru, &dirhash_lru);
+	spin_unlock(&dirhash_lock);
+
+	if (!(e = dirhash_lookup(h, dentry->d_name.name, dentry->d_name.len)))
+		return NULL;
+	page = simplefs_get_page(dir, e->d_pos >> PAGE_CACHE_SHIFT);
+	if (IS_ERR(page))
+		return ERR_CAST(page);
+	de = (struct simplefs_dentry *)((char *)page_address(page) + (e->d_pos & ~PAGE_CACHE_MASK));
+	if (de->flags == SIMPLEFS_DENTRY_UNUSED ||
+	    strnlen(de->name, SIMPLEFS_NAME_LEN) != e->d_len ||
+	    memcmp(de->name, e->d_name, e->d_len)) {
+		printk(KERN_ERR "simplefs_dirhash_find: stale index for %ld\n", dir->i_ino);
+		simplefs_put_page(page);
+		simplefs_dirhash_drop(dir);
+		return ERR_PTR(-EAGAIN);
+	}
+	*rs_page = page;
+	return de;
+}
+
+void simplefs_dirhash_add(struct inode *dir, const char *name, int len, loff_t pos) {
+	struct simplefs_dirhash *h = SIMPLEFS_I(dir)->i_dirhash;
+
+	if (h && dirhash_insert(h, name, len, pos))
+		simplefs_dirhash_drop(dir);
+}
+
+void simplefs_dirhash_remove(struct inode *dir, const char *name, int len) {
+	struct simplefs_dirhash *h = SIMPLEFS_I(dir)->i_dirhash;
+	struct simplefs_dirhash_entry *e;
+
+	if (!h || !(e = dirhash_lookup(h, name, len)))
+		return;
+	hlist_del(&e->d_hash);
+	kfree(e);
+	h->h_count--;
+	spin_lock(&dirhash_lock);
+	dirhash_entries--;
+	spin_unlock(&dirhash_lock);
+}
+
+#define DIRHASH_SHRINK_BATCH 16
+
+/*
+ * Drop the least recently used indexes. The directories are pinned
+ * under dirhash_lock and their i_mutex is only tried once the spinlock
+ * is dropped. Directories that are busy are skipped, their i_mutex
+ * protects the table.
+ */
+static int simplefs_dirhash_shrink(int nr_to_scan, gfp_t gfp_mask) {
+	struct inode *dirs[DIRHASH_SHRINK_BATCH];
+	struct simplefs_dirhash *h;
+	unsigned long count;
+	int i, n = 0;
+
+	if (nr_to_scan && !(gfp_mask & __GFP_FS))
+		return -1;
+	spin_lock(&dirhash_lock);
+	list_for_each_entry(h, &dirhash_lru, h_lru) {
+		if (nr_to_scan <= 0 || n == DIRHASH_SHRINK_BATCH)
+			break;
+		if (!(dirs[n] = igrab(h->h_dir)))
+			continue;
+		nr_to_scan -= h->h_count;
+		n++;
+	}
+	spin_unlock(&dirhash_lock);
+
+	for (i = 0; i < n; i++) {
+		h = NULL;
+		if (mutex_trylock(&dirs[i]->i_mutex)) {
+			spin_lock(&dirhash_lock);
+			if ((h = SIMPLEFS_I(dirs[i])->i_dirhash)) {
+				SIMPLEFS_I(dirs[i])->i_dirhash = NULL;
+				list_del(&h->h_lru);
+				dirhash_entries -= h->h_count;
+			}
+			spin_unlock(&dirhash_lock);
+			mutex_unlock(&dirs[i]->i_mutex);
+		}
+		if (h)
+			dirhash_free(h);
+		iput(dirs[i]);
+	}
+
+	spin_lock(&dirhash_lock);
+	count = dirhash_entries;
+	spin_unlock(&dirhash_lock);
+	return (count / 100) * sysctl_vfs_cache_pressure;
+}
+
+static struct shrinker simplefs_dirhash_shrinker = {
+	.shrink = simplefs_dirhash_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+void simplefs_dirhash_init(void) {
+	register_shrinker(&simplefs_dirhash_shrinker);
+}
+
+void simplefs_dirhash_exit(void) {
+	unregister_shrinker(&simplefs_dirhash_shrinker);
+}
@@ -5,16 +5,133 @@
  * fangdong@pipul.org
  */
 
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
 #include "simplefs.h"
+#include "trace.h"
+
+/*
+ * Flush the device write caches once for everybody who finished their
+ * writes before the flush started. Fsyncs that queue up behind a flush
+ * in progress share the next one instead of issuing their own.
+ */
+static int simplefs_flush_device(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	unsigned long seq, target;
+	int i, ret, err = 0;
+
+	seq = atomic_long_inc_return(&sbi->s_flush_seq);
+	mutex_lock(&sbi->s_flush_mutex);
+	if (time_before_eq(seq, sbi->s_flush_done))
+		goto out;
+	target = atomic_long_read(&sbi->s_flush_seq);
+	for (i = 0; i < sbi->s_nr_devices; i++) {
+		ret = blkdev_issue_flush(sbi->s_devs[i], NULL);
+		if (ret && ret != -EOPNOTSUPP && !err)
+			err = ret;
+	}
+	if (!err)
+		sbi->s_flush_done = target;
+ out:
+	mutex_unlock(&sbi->s_flush_mutex);
+	return err;
+}
+
+/*
+ * The VFS has already written and waited on the file's dirty pages.
+ * What is left is the inode block, which only has to go out for
+ * fdatasync when the size or the block mapping changed, and the
+ * device cache.
+ */
+int simplefs_fsync(struct file *file, struct dentry *dentry, int datasync) {
+	struct inode *inode = dentry->d_inode;
+	int err, ret;
+
+	trace_simplefs_fsync(inode, datasync);
+	ret = sync_mapping_buffers(inode->i_mapping);
+	if ((inode->i_state & I_DIRTY_DATASYNC) ||
+	    (!datasync && (inode->i_state & I_DIRTY_SYNC))) {
+		err = simplefs_sync_inode(inode);
+		if (!ret)
+			ret = err;
+	}
+	err = simplefs_flush_device(inode->i_sb);
+	if (!ret)
+		ret = err;
+	return ret;
+}
+
+/* count reads and writes towards the heat of the file, see heat.c */
+static ssize_t simplefs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+				      unsigned long nr_segs, loff_t pos) {
+	struct inode *inode = iocb->ki_filp->f_path.dentry->d_inode;
+
+	trace_simplefs_read(inode, pos, iov_length(iov, nr_segs));
+	simplefs_heat_touch(inode, 0);
+	return generic_file_aio_read(iocb, iov, nr_segs, pos);
+}
+
+static ssize_t simplefs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
+				       unsigned long nr_segs, loff_t pos) {
+	struct inode *inode = iocb->ki_filp->f_path.dentry->d_inode;
+
+	trace_simplefs_write(inode, pos, iov_length(iov, nr_segs));
+	simplefs_heat_touch(inode, 1);
+	return generic_file_aio_write(iocb, iov, nr_segs, pos);
+}
+
+static const struct vm_operations_struct simplefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.page_mkwrite = simplefs_page_mkwrite,
+};
+
+/* generic_file_mmap, with blocks mapped when a page is first written */
+static int simplefs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+	struct address_space *mapping = file->f_mapping;
+
+	if (!mapping->a_ops->readpage)
+		return -ENOEXEC;
+	file_accessed(file);
+	vma->vm_ops = &simplefs_file_vm_ops;
+	vma->vm_flags |= VM_CAN_NONLINEAR;
+	return 0;
+}
+
+/*
+ * sendfile and splice move page cache pages straight into the pipe,
+ * and splice writes go through write_begin/write_end like write().
+ */
+static ssize_t simplefs_file_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+					 size_t len, unsigned int flags) {
+	struct inode *inode = in->f_path.dentry->d_inode;
+
+	trace_simplefs_read(inode, *ppos, len);
+	simplefs_heat_touch(inode, 0);
+	return generic_file_splice_read(in, ppos, pipe, len, flags);
+}
+
+static ssize_t simplefs_file_splice_write(struct pipe_inode_info *pipe, struct file *out, loff_t *ppos,
+					  size_t len, unsigned int flags) {
+	struct inode *inode = out->f_path.dentry->d_inode;
+
+	trace_simplefs_write(inode, *ppos, len);
+	simplefs_heat_touch(inode, 1);
+	return generic_file_splice_write(pipe, out, ppos, len, flags);
+}
 
 const struct file_operations simplefs_file_operations = {
 	.llseek = generic_file_llseek,
 	.read = do_sync_read,
 	.write = do_sync_write,
-	.aio_read = generic_file_aio_read,
-	.aio_write = generic_file_aio_write,
-	.mmap = generic_file_mmap,
-	.fsync = simple_fsync,
+	.aio_read = simplefs_file_aio_read,
+	.aio_write = simplefs_file_aio_write,
+	.mmap = simplefs_file_mmap,
+	.splice_read = simplefs_file_splice_read,
+	.splice_write = simplefs_file_splice_write,
+	.fsync = simplefs_fsync,
+	.unlocked_ioctl = simplefs_ioctl,
 };
 
 
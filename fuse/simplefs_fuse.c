@@ -0,0 +1,1852 @@
+/*
+ * fuse/simplefs_fuse.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ *
+ * Serve a simplefs image from userspace, for hosts that cannot load the
+ * kernel module. It reads and writes the same on-disk format as the
+ * module: the superblock, the inode and block bitmaps, the inode table,
+ * the refcount table and compressed clusters.
+ *
+ * The daemon keeps its own block cache and inode cache. Block I/O is
+ * batched through io_uring: a request that needs several blocks submits
+ * all of them at once, with neighbouring blocks merged into one vectored
+ * read or write. If io_uring is not available it falls back to
+ * preadv/pwritev.
+ *
+ * Requests run on libfuse's thread pool. Reads share fs->lock, while
+ * anything that changes the image takes it exclusively.
+ */
+
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+
+#include <fuse_lowlevel.h>
+#include <liburing.h>
+#include <lzo/lzo1x.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+#error "simplefs images are little endian, like the hosts the module runs on"
+#endif
+
+/* on-disk format, see simplefs.h */
+
+#define SIMPLEFS_ROOT_INO 0
+#define SIMPLEFS_SUPER_BNO 0
+#define SIMPLEFS_BITMAP_BNO 1
+#define SIMPLEFS_BLOCKSIZE 512
+#define SIMPLEFS_BLOCKBITS 9
+#define SIMPLEFS_BLOCKS_PER_INODE 15
+#define SIMPLEFS_NAME_LEN 20
+#define SIMPLEFS_DENTRY_UNUSED 0x01
+#define SIMPLEFS_DENTRY_INUSED 0x02
+#define SIMPLEFS_FLAGS_SHIFT 16
+#define SIMPLEFS_INODE_COMPR 0x0001
+#define SIMPLEFS_COMPR_MARK 0xffffffff
+#define SIMPLEFS_REF_MAX 255
+
+/* PAGE_CACHE_SIZE of the kernel the images are shared with */
+#define SIMPLEFS_CLUSTER 4096
+#define SIMPLEFS_BLOCKS_PER_CLUSTER (SIMPLEFS_CLUSTER >> SIMPLEFS_BLOCKBITS)
+#define SIMPLEFS_MAX_SIZE (SIMPLEFS_BLOCKS_PER_INODE * SIMPLEFS_BLOCKSIZE)
+#define SIMPLEFS_ORPHAN_OFFSET 64
+#define SIMPLEFS_ORPHANS ((SIMPLEFS_BLOCKSIZE - SIMPLEFS_ORPHAN_OFFSET) / sizeof(uint32_t))
+#define SIMPLEFS_ORPHAN_MAGIC 0x4e50524f
+
+struct simplefs_super {
+	uint32_t s_inode_bitmap_blknr;
+	uint32_t s_inode_blknr;
+	uint32_t s_free_inodes_count;
+	uint32_t s_block_bitmap_blknr;
+	uint32_t s_block_blknr;
+	uint32_t s_free_blocks_count;
+	uint32_t s_refcount_blknr;
+	uint32_t s_nr_devices;
+	uint32_t s_stripe_blknr;
+	uint32_t s_fsid;
+	uint32_t s_orphan_magic;
+};
+
+struct simplefs_inode {
+	uint32_t i_size;
+	uint32_t i_time;
+	uint32_t i_mode;
+	uint32_t i_nlink;
+	uint32_t i_data[SIMPLEFS_BLOCKS_PER_INODE];
+};
+
+struct simplefs_dentry {
+	uint32_t inode;
+	uint32_t flags;
+	char name[SIMPLEFS_NAME_LEN];
+};
+
+#define SIMPLEFS_INODES_PER_BLOCK (SIMPLEFS_BLOCKSIZE / sizeof(struct simplefs_inode))
+#define SIMPLEFS_DENTRY_SIZE sizeof(struct simplefs_dentry)
+#define BITS_PER_BLOCK (SIMPLEFS_BLOCKSIZE * 8)
+
+static int slot_mapped(uint32_t slot) {
+	return slot && slot != SIMPLEFS_COMPR_MARK;
+}
+
+
+/*
+ * Block cache
+ */
+
+enum { CB_LOADING, CB_READY, CB_ERROR };
+
+struct cblock {
+	uint64_t bno;
+	int state;
+	int dirty;
+	int pins;
+	struct cblock *hnext;
+	struct cblock *prev, *next;	/* LRU, most recently used first */
+	unsigned char data[SIMPLEFS_BLOCKSIZE];
+};
+
+struct bcache {
+	pthread_mutex_t lock;
+	pthread_cond_t loaded;
+	struct cblock **hash;
+	size_t hash_size;
+	struct cblock lru;
+	size_t count, max, ndirty;
+};
+
+/*
+ * Inode cache. Entries are pinned while a request uses them and hold
+ * the kernel's lookup count and the number of open handles, so that
+ * unlinked inodes are only freed once nothing refers to them.
+ */
+struct sfs_inode {
+	uint32_t ino;
+	uint64_t nlookup;
+	uint32_t nopen;
+	int pins;
+	struct simplefs_inode raw;
+	struct sfs_inode *next;
+};
+
+#define ICACHE_HASH 1024
+
+struct icache {
+	pthread_mutex_t lock;
+	struct sfs_inode *hash[ICACHE_HASH];
+	size_t count, max;
+};
+
+struct sfs {
+	int fd;
+	struct simplefs_super sb;
+	uint64_t inode_start, refcount_start, data_start;
+	uint32_t ninodes, nblocks;
+	uint32_t ino_hint, blk_hint;
+	uint32_t free_inodes, free_blocks;
+	pthread_rwlock_t lock;
+	struct bcache bc;
+	struct icache ic;
+	double timeout;
+};
+
+
+/*
+ * Batched block I/O
+ */
+
+#define RING_DEPTH 64
+#define RUN_MAX 64
+
+static pthread_key_t ring_key;
+
+static void ring_free(void *p) {
+	io_uring_queue_exit(p);
+	free(p);
+}
+
+/* one ring per thread, or NULL when io_uring can't be used */
+static struct io_uring *get_ring(void) {
+	static __thread int failed;
+	struct io_uring *ring;
+
+	if (failed)
+		return NULL;
+	if ((ring = pthread_getspecific(ring_key)))
+		return ring;
+	if (!(ring = malloc(sizeof(*ring))) || io_uring_queue_init(RING_DEPTH, ring, 0) < 0) {
+		free(ring);
+		failed = 1;
+		return NULL;
+	}
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+static int cblock_cmp(const void *a, const void *b) {
+	const struct cblock *x = *(struct cblock *const *)a, *y = *(struct cblock *const *)b;
+
+	return x->bno < y->bno ? -1 : x->bno > y->bno;
+}
+
+/* length of the run of consecutive blocks starting at cbs[i] */
+static int run_len(struct cblock **cbs, int i, int n) {
+	int j = i + 1;
+
+	while (j < n && j - i < RUN_MAX && cbs[j]->bno == cbs[j - 1]->bno + 1)
+		j++;
+	return j - i;
+}
+
+static int sync_io(int fd, struct cblock **cbs, int n, int write) {
+	struct iovec iov[RUN_MAX];
+	int i, k, len;
+	ssize_t ret;
+
+	for (i = 0; i < n; i += len) {
+		len = run_len(cbs, i, n);
+		for (k = 0; k < len; k++) {
+			iov[k].iov_base = cbs[i + k]->data;
+			iov[k].iov_len = SIMPLEFS_BLOCKSIZE;
+		}
+		if (write)
+			ret = pwritev(fd, iov, len, cbs[i]->bno << SIMPLEFS_BLOCKBITS);
+		else
+			ret = preadv(fd, iov, len, cbs[i]->bno << SIMPLEFS_BLOCKBITS);
+		if (ret != (ssize_t)len << SIMPLEFS_BLOCKBITS)
+			return ret < 0 ? -errno : -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read or write a set of blocks sorted by block number. Neighbouring
+ * blocks go out as one vectored request, and every request is in
+ * flight before we wait for any of them.
+ */
+static int batch_io(int fd, struct cblock **cbs, int n, int write) {
+	struct io_uring *ring = get_ring();
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct iovec *iov;
+	int i = 0, k, len, inflight = 0, err = 0;
+
+	if (!n)
+		return 0;
+	if (!ring)
+		return sync_io(fd, cbs, n, write);
+	if (!(iov = malloc(n * sizeof(*iov))))
+		return -ENOMEM;
+	for (k = 0; k < n; k++) {
+		iov[k].iov_base = cbs[k]->data;
+		iov[k].iov_len = SIMPLEFS_BLOCKSIZE;
+	}
+	while (i < n || inflight) {
+		while (i < n && (sqe = io_uring_get_sqe(ring))) {
+			len = run_len(cbs, i, n);
+			if (write)
+				io_uring_prep_writev(sqe, fd, iov + i, len, cbs[i]->bno << SIMPLEFS_BLOCKBITS);
+			else
+				io_uring_prep_readv(sqe, fd, iov + i, len, cbs[i]->bno << SIMPLEFS_BLOCKBITS);
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)(len << SIMPLEFS_BLOCKBITS));
+			inflight++;
+			i += len;
+		}
+		if ((k = io_uring_submit_and_wait(ring, 1)) < 0) {
+			err = k;
+			break;
+		}
+		while (io_uring_peek_cqe(ring, &cqe) == 0) {
+			if (cqe->res != (int)(uintptr_t)io_uring_cqe_get_data(cqe) && !err)
+				err = cqe->res < 0 ? cqe->res : -EIO;
+			io_uring_cqe_seen(ring, cqe);
+			inflight--;
+		}
+	}
+	free(iov);
+	return err;
+}
+
+static int sync_device(int fd) {
+	struct io_uring *ring = get_ring();
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int err;
+
+	if (!ring || !(sqe = io_uring_get_sqe(ring)))
+		return fdatasync(fd) ? -errno : 0;
+	io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+	if ((err = io_uring_submit_and_wait(ring, 1)) < 0)
+		return err;
+	if ((err = io_uring_wait_cqe(ring, &cqe)) < 0)
+		return err;
+	err = cqe->res;
+	io_uring_cqe_seen(ring, cqe);
+	return err;
+}
+
+
+/*
+ * Block cache
+ */
+
+static void lru_del(struct cblock *cb) {
+	cb->prev->next = cb->next;
+	cb->next->prev = cb->prev;
+}
+
+static void lru_add(struct bcache *bc, struct cblock *cb) {
+	cb->next = bc->lru.next;
+	cb->prev = &bc->lru;
+	bc->lru.next->prev = cb;
+	bc->lru.next = cb;
+}
+
+static struct cblock **bucket(struct bcache *bc, uint64_t bno) {
+	return &bc->hash[(bno * 0x9e3779b97f4a7c15ULL >> 32) % bc->hash_size];
+}
+
+static struct cblock *cache_find(struct bcache *bc, uint64_t bno) {
+	struct cblock *cb;
+
+	for (cb = *bucket(bc, bno); cb; cb = cb->hnext) {
+		if (cb->bno == bno)
+			return cb;
+	}
+	return NULL;
+}
+
+/* drop clean, unused blocks from the cold end until we are under max */
+static void cache_shrink(struct bcache *bc) {
+	struct cblock *cb, *prev, **pp;
+
+	for (cb = bc->lru.prev; cb != &bc->lru && bc->count >= bc->max; cb = prev) {
+		prev = cb->prev;
+		if (cb->pins || cb->dirty || cb->state != CB_READY)
+			continue;
+		for (pp = bucket(bc, cb->bno); *pp != cb; pp = &(*pp)->hnext)
+			;
+		*pp = cb->hnext;
+		lru_del(cb);
+		bc->count--;
+		free(cb);
+	}
+}
+
+/*
+ * Pin n blocks, reading the ones that are not cached in one batch.
+ * With noread the caller overwrites the whole block, so a missing
+ * block is just zeroed.
+ */
+static int bget_many(struct sfs *fs, const uint64_t *bnos, int n, struct cblock **out, int noread) {
+	struct bcache *bc = &fs->bc;
+	struct cblock *cb, **loads;
+	int i, nl = 0, err = 0;
+
+	if (!(loads = malloc(n * sizeof(*loads))))
+		return -ENOMEM;
+	pthread_mutex_lock(&bc->lock);
+	for (i = 0; i < n; i++) {
+		if (!(cb = cache_find(bc, bnos[i]))) {
+			cache_shrink(bc);
+			if (!(cb = calloc(1, sizeof(*cb)))) {
+				err = -ENOMEM;
+				break;
+			}
+			cb->bno = bnos[i];
+			cb->state = CB_ERROR;
+			cb->hnext = *bucket(bc, cb->bno);
+			*bucket(bc, cb->bno) = cb;
+			bc->count++;
+		} else {
+			lru_del(cb);
+		}
+		lru_add(bc, cb);
+		if (cb->state == CB_ERROR) {
+			if (noread) {
+				memset(cb->data, 0, SIMPLEFS_BLOCKSIZE);
+				cb->state = CB_READY;
+			} else {
+				cb->state = CB_LOADING;
+				loads[nl++] = cb;
+			}
+		}
+		cb->pins++;
+		out[i] = cb;
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	if (nl) {
+		int state;
+
+		qsort(loads, nl, sizeof(*loads), cblock_cmp);
+		state = batch_io(fs->fd, loads, nl, 0) ? CB_ERROR : CB_READY;
+		pthread_mutex_lock(&bc->lock);
+		for (i = 0; i < nl; i++)
+			loads[i]->state = state;
+		pthread_cond_broadcast(&bc->loaded);
+		pthread_mutex_unlock(&bc->lock);
+	}
+	free(loads);
+
+	pthread_mutex_lock(&bc->lock);
+	for (n = i, i = 0; i < n; i++) {
+		while (out[i]->state == CB_LOADING)
+			pthread_cond_wait(&bc->loaded, &bc->lock);
+		if (out[i]->state == CB_ERROR && !err)
+			err = -EIO;
+	}
+	if (err) {
+		for (i = 0; i < n; i++)
+			out[i]->pins--;
+	}
+	pthread_mutex_unlock(&bc->lock);
+	return err;
+}
+
+static struct cblock *bget(struct sfs *fs, uint64_t bno, int noread) {
+	struct cblock *cb;
+
+	return bget_many(fs, &bno, 1, &cb, noread) ? NULL : cb;
+}
+
+static void bput(struct sfs *fs, struct cblock *cb) {
+	pthread_mutex_lock(&fs->bc.lock);
+	cb->pins--;
+	pthread_mutex_unlock(&fs->bc.lock);
+}
+
+static void bdirty(struct sfs *fs, struct cblock *cb) {
+	pthread_mutex_lock(&fs->bc.lock);
+	if (!cb->dirty) {
+		cb->dirty = 1;
+		fs->bc.ndirty++;
+	}
+	pthread_mutex_unlock(&fs->bc.lock);
+}
+
+/*
+ * Write every dirty block in one batch. Called with fs->lock held
+ * exclusively, so no block changes while it is written.
+ */
+static int bflush(struct sfs *fs, int sync) {
+	struct bcache *bc = &fs->bc;
+	struct cblock *cb, **dirty;
+	size_t i, n = 0;
+	int err;
+
+	pthread_mutex_lock(&bc->lock);
+	if (!(dirty = malloc((bc->ndirty + 1) * sizeof(*dirty)))) {
+		pthread_mutex_unlock(&bc->lock);
+		return -ENOMEM;
+	}
+	for (cb = bc->lru.next; cb != &bc->lru; cb = cb->next) {
+		if (cb->dirty) {
+			cb->pins++;
+			dirty[n++] = cb;
+		}
+	}
+	pthread_mutex_unlock(&bc->lock);
+
+	qsort(dirty, n, sizeof(*dirty), cblock_cmp);
+	err = batch_io(fs->fd, dirty, n, 1);
+
+	pthread_mutex_lock(&bc->lock);
+	for (i = 0; i < n; i++) {
+		if (!err) {
+			dirty[i]->dirty = 0;
+			bc->ndirty--;
+		}
+		dirty[i]->pins--;
+	}
+	pthread_mutex_unlock(&bc->lock);
+	free(dirty);
+	if (!err && sync)
+		err = sync_device(fs->fd);
+	return err;
+}
+
+/* write back early once a quarter of the cache is dirty */
+static void bbalance(struct sfs *fs) {
+	if (fs->bc.ndirty > fs->bc.max / 4)
+		bflush(fs, 0);
+}
+
+
+/*
+ * Bitmaps and refcounts
+ */
+
+static uint64_t bitmap_bno(struct sfs *fs, int block_bitmap, uint32_t nr) {
+	return SIMPLEFS_BITMAP_BNO + (block_bitmap ? fs->sb.s_inode_bitmap_blknr : 0) + nr / BITS_PER_BLOCK;
+}
+
+static int bit_test(struct cblock *cb, uint32_t nr) {
+	nr %= BITS_PER_BLOCK;
+	return cb->data[nr >> 3] & (1 << (nr & 7));
+}
+
+static void bit_set(struct sfs *fs, struct cblock *cb, uint32_t nr, int val) {
+	nr %= BITS_PER_BLOCK;
+	if (val)
+		cb->data[nr >> 3] |= 1 << (nr & 7);
+	else
+		cb->data[nr >> 3] &= ~(1 << (nr & 7));
+	bdirty(fs, cb);
+}
+
+/* next fit: search from just after the last allocation */
+static long bitmap_alloc(struct sfs *fs, int block_bitmap, uint32_t total, uint32_t *hint) {
+	struct cblock *cb = NULL;
+	uint32_t i, nr;
+
+	for (i = 0; i < total; i++) {
+		nr = (*hint + i) % total;
+		if (!cb || nr % BITS_PER_BLOCK == 0 || cb->bno != bitmap_bno(fs, block_bitmap, nr)) {
+			if (cb)
+				bput(fs, cb);
+			if (!(cb = bget(fs, bitmap_bno(fs, block_bitmap, nr), 0)))
+				return -EIO;
+		}
+		if (cb->data[(nr % BITS_PER_BLOCK) >> 3] == 0xff) {
+			i += 7 - (nr & 7);
+			continue;
+		}
+		if (!bit_test(cb, nr)) {
+			bit_set(fs, cb, nr, 1);
+			bput(fs, cb);
+			*hint = nr + 1;
+			return nr;
+		}
+	}
+	if (cb)
+		bput(fs, cb);
+	return -ENOSPC;
+}
+
+static void bitmap_free(struct sfs *fs, int block_bitmap, uint32_t nr) {
+	struct cblock *cb;
+
+	if (!(cb = bget(fs, bitmap_bno(fs, block_bitmap, nr), 0)))
+		return;
+	bit_set(fs, cb, nr, 0);
+	bput(fs, cb);
+}
+
+static long alloc_block(struct sfs *fs) {
+	long nr = bitmap_alloc(fs, 1, fs->nblocks, &fs->blk_hint);
+
+	if (nr < 0)
+		return nr;
+	fs->free_blocks--;
+	return fs->data_start + nr;
+}
+
+static struct cblock *ref_block(struct sfs *fs, uint32_t bno, unsigned char **ref) {
+	uint64_t rel = bno - fs->data_start;
+	struct cblock *cb;
+
+	if (!fs->sb.s_refcount_blknr || !(cb = bget(fs, fs->refcount_start + rel / SIMPLEFS_BLOCKSIZE, 0)))
+		return NULL;
+	*ref = cb->data + rel % SIMPLEFS_BLOCKSIZE;
+	return cb;
+}
+
+static int block_shared(struct sfs *fs, uint32_t bno) {
+	unsigned char *ref;
+	struct cblock *cb;
+	int shared;
+
+	if (!(cb = ref_block(fs, bno, &ref)))
+		return 0;
+	shared = *ref != 0;
+	bput(fs, cb);
+	return shared;
+}
+
+/* same as bitmap_free_block: a shared block only loses one owner */
+static void free_block(struct sfs *fs, uint32_t bno) {
+	unsigned char *ref;
+	struct cblock *cb;
+
+	if ((cb = ref_block(fs, bno, &ref))) {
+		if (*ref) {
+			(*ref)--;
+			bdirty(fs, cb);
+			bput(fs, cb);
+			return;
+		}
+		bput(fs, cb);
+	}
+	bitmap_free(fs, 1, bno - fs->data_start);
+	fs->free_blocks++;
+}
+
+
+/*
+ * Inodes
+ */
+
+static uint64_t inode_bno(struct sfs *fs, uint32_t ino) {
+	return fs->inode_start + ino / SIMPLEFS_INODES_PER_BLOCK;
+}
+
+static int raw_read(struct sfs *fs, uint32_t ino, struct simplefs_inode *raw) {
+	struct cblock *cb;
+
+	if (!(cb = bget(fs, inode_bno(fs, ino), 0)))
+		return -EIO;
+	memcpy(raw, cb->data + ino % SIMPLEFS_INODES_PER_BLOCK * sizeof(*raw), sizeof(*raw));
+	bput(fs, cb);
+	return 0;
+}
+
+/* inode changes go straight to the cached inode table block */
+static int iwrite(struct sfs *fs, struct sfs_inode *si) {
+	struct cblock *cb;
+
+	if (!(cb = bget(fs, inode_bno(fs, si->ino), 0)))
+		return -EIO;
+	memcpy(cb->data + si->ino % SIMPLEFS_INODES_PER_BLOCK * sizeof(si->raw), &si->raw, sizeof(si->raw));
+	bdirty(fs, cb);
+	bput(fs, cb);
+	return 0;
+}
+
+static int iget(struct sfs *fs, uint32_t ino, struct sfs_inode **out) {
+	struct icache *ic = &fs->ic;
+	struct sfs_inode *si, **pp;
+	int err;
+
+	if (ino >= fs->ninodes)
+		return -ENOENT;
+	pthread_mutex_lock(&ic->lock);
+	for (si = ic->hash[ino % ICACHE_HASH]; si; si = si->next) {
+		if (si->ino == ino)
+			goto found;
+	}
+	/* forget unused entries in this chain before adding one */
+	if (ic->count >= ic->max) {
+		for (pp = &ic->hash[ino % ICACHE_HASH]; (si = *pp); ) {
+			if (!si->pins && !si->nlookup && !si->nopen) {
+				*pp = si->next;
+				free(si);
+				ic->count--;
+			} else {
+				pp = &si->next;
+			}
+		}
+	}
+	if (!(si = calloc(1, sizeof(*si)))) {
+		pthread_mutex_unlock(&ic->lock);
+		return -ENOMEM;
+	}
+	si->ino = ino;
+	if ((err = raw_read(fs, ino, &si->raw))) {
+		pthread_mutex_unlock(&ic->lock);
+		free(si);
+		return err;
+	}
+	si->next = ic->hash[ino % ICACHE_HASH];
+	ic->hash[ino % ICACHE_HASH] = si;
+	ic->count++;
+ found:
+	si->pins++;
+	pthread_mutex_unlock(&ic->lock);
+	*out = si;
+	return 0;
+}
+
+static void iput(struct sfs *fs, struct sfs_inode *si) {
+	pthread_mutex_lock(&fs->ic.lock);
+	si->pins--;
+	pthread_mutex_unlock(&fs->ic.lock);
+}
+
+static int is_compr(struct sfs_inode *si) {
+	return (si->raw.i_mode >> SIMPLEFS_FLAGS_SHIFT) & SIMPLEFS_INODE_COMPR;
+}
+
+static uint32_t size_blocks(uint32_t size) {
+	return (size + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+}
+
+static void stat_inode(struct sfs_inode *si, struct stat *st) {
+	memset(st, 0, sizeof(*st));
+	st->st_ino = si->ino + FUSE_ROOT_ID;
+	st->st_mode = si->raw.i_mode & 0xffff;
+	st->st_nlink = si->raw.i_nlink;
+	st->st_size = si->raw.i_size;
+	st->st_blocks = size_blocks(si->raw.i_size);
+	st->st_blksize = SIMPLEFS_BLOCKSIZE;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = st->st_mtime = st->st_ctime = si->raw.i_time;
+}
+
+static void touch(struct sfs_inode *si) {
+	si->raw.i_time = time(NULL);
+}
+
+
+/*
+ * File data
+ */
+
+static int plain_read(struct sfs *fs, struct sfs_inode *si, char *buf, uint32_t off, uint32_t len) {
+	uint64_t bnos[SIMPLEFS_BLOCKS_PER_INODE];
+	struct cblock *cbs[SIMPLEFS_BLOCKS_PER_INODE];
+	uint32_t b, first, n, pos, chunk;
+	int err;
+
+	first = off >> SIMPLEFS_BLOCKBITS;
+	n = size_blocks(off + len) - first;
+	for (b = 0; b < n; b++) {
+		if (!slot_mapped(si->raw.i_data[first + b]))
+			return -EIO;
+		bnos[b] = si->raw.i_data[first + b];
+	}
+	if ((err = bget_many(fs, bnos, n, cbs, 0)))
+		return err;
+	for (b = 0, pos = off; pos < off + len; b++, pos += chunk) {
+		chunk = SIMPLEFS_BLOCKSIZE - pos % SIMPLEFS_BLOCKSIZE;
+		if (chunk > off + len - pos)
+			chunk = off + len - pos;
+		memcpy(buf + pos - off, cbs[b]->data + pos % SIMPLEFS_BLOCKSIZE, chunk);
+	}
+	for (b = 0; b < n; b++)
+		bput(fs, cbs[b]);
+	return 0;
+}
+
+/* give the inode its own copy of slot b, like simplefs_cow_block */
+static int cow_block(struct sfs *fs, struct sfs_inode *si, uint32_t b) {
+	struct cblock *old, *new;
+	long bno;
+
+	if (!block_shared(fs, si->raw.i_data[b]))
+		return 0;
+	if ((bno = alloc_block(fs)) < 0)
+		return bno;
+	if (!(old = bget(fs, si->raw.i_data[b], 0)))
+		return -EIO;
+	if (!(new = bget(fs, bno, 1))) {
+		bput(fs, old);
+		return -EIO;
+	}
+	memcpy(new->data, old->data, SIMPLEFS_BLOCKSIZE);
+	bdirty(fs, new);
+	bput(fs, new);
+	bput(fs, old);
+	free_block(fs, si->raw.i_data[b]);
+	si->raw.i_data[b] = bno;
+	return 0;
+}
+
+/*
+ * Files have no holes: blocks between the old end and the write are
+ * allocated and zeroed, and so is the stale tail of the old last block.
+ */
+static int plain_write(struct sfs *fs, struct sfs_inode *si, const char *buf, uint32_t off, uint32_t len) {
+	uint64_t bnos[SIMPLEFS_BLOCKS_PER_INODE];
+	struct cblock *cbs[SIMPLEFS_BLOCKS_PER_INODE];
+	uint32_t b, have, last, size = si->raw.i_size;
+	uint32_t start, pos, chunk;
+	long bno;
+	int err, fresh;
+
+	have = size_blocks(size);
+	last = size_blocks(off + len);
+	start = (off < size ? off : size) >> SIMPLEFS_BLOCKBITS;
+	for (b = have; b < last; b++) {
+		if ((bno = alloc_block(fs)) < 0)
+			return bno;
+		si->raw.i_data[b] = bno;
+	}
+	for (b = start; b < have && b < last; b++) {
+		if ((err = cow_block(fs, si, b)))
+			return err;
+	}
+
+	for (b = start; b < last; b++) {
+		fresh = b >= have ||
+			(b << SIMPLEFS_BLOCKBITS >= off && (b + 1) << SIMPLEFS_BLOCKBITS <= off + len);
+		bnos[0] = si->raw.i_data[b];
+		if ((err = bget_many(fs, bnos, 1, cbs, fresh)))
+			return err;
+		if (b >= have)
+			memset(cbs[0]->data, 0, SIMPLEFS_BLOCKSIZE);
+		else if (size < (b + 1) << SIMPLEFS_BLOCKBITS && size % SIMPLEFS_BLOCKSIZE)
+			memset(cbs[0]->data + size % SIMPLEFS_BLOCKSIZE, 0,
+			       SIMPLEFS_BLOCKSIZE - size % SIMPLEFS_BLOCKSIZE);
+		pos = b << SIMPLEFS_BLOCKBITS;
+		if (pos < off)
+			pos = off;
+		for (; pos < off + len && pos < (b + 1) << SIMPLEFS_BLOCKBITS; pos += chunk) {
+			chunk = SIMPLEFS_BLOCKSIZE - pos % SIMPLEFS_BLOCKSIZE;
+			if (chunk > off + len - pos)
+				chunk = off + len - pos;
+			memcpy(cbs[0]->data + pos % SIMPLEFS_BLOCKSIZE, buf + pos - off, chunk);
+		}
+		bdirty(fs, cbs[0]);
+		bput(fs, cbs[0]);
+	}
+	if (off + len > size)
+		si->raw.i_size = off + len;
+	return 0;
+}
+
+/* number of bytes of cluster c below i_size */
+static uint32_t cluster_bytes(uint32_t size, uint32_t c) {
+	uint32_t start = c * SIMPLEFS_CLUSTER;
+
+	if (size <= start)
+		return 0;
+	return size - start < SIMPLEFS_CLUSTER ? size - start : SIMPLEFS_CLUSTER;
+}
+
+static uint32_t cluster_slots(uint32_t c) {
+	uint32_t first = c * SIMPLEFS_BLOCKS_PER_CLUSTER;
+
+	if (first >= SIMPLEFS_BLOCKS_PER_INODE)
+		return 0;
+	return SIMPLEFS_BLOCKS_PER_INODE - first < SIMPLEFS_BLOCKS_PER_CLUSTER ?
+		SIMPLEFS_BLOCKS_PER_INODE - first : SIMPLEFS_BLOCKS_PER_CLUSTER;
+}
+
+/* the same decoding as simplefs_compr_fill_page */
+static int cluster_read(struct sfs *fs, struct sfs_inode *si, uint32_t c, unsigned char *out) {
+	uint32_t *slots = si->raw.i_data + c * SIMPLEFS_BLOCKS_PER_CLUSTER;
+	uint32_t i, used, need, bytes = cluster_bytes(si->raw.i_size, c);
+	unsigned char cbuf[SIMPLEFS_CLUSTER];
+	uint64_t bnos[SIMPLEFS_BLOCKS_PER_CLUSTER];
+	struct cblock *cbs[SIMPLEFS_BLOCKS_PER_CLUSTER];
+	lzo_uint out_len = SIMPLEFS_CLUSTER;
+	uint32_t c_len;
+	int compressed, err;
+
+	memset(out, 0, SIMPLEFS_CLUSTER);
+	need = size_blocks(bytes);
+	for (used = 0; used < cluster_slots(c) && slot_mapped(slots[used]); used++)
+		bnos[used] = slots[used];
+	if (!bytes || !used)
+		return 0;
+	compressed = used < cluster_slots(c) && slots[used] == SIMPLEFS_COMPR_MARK;
+	if (!compressed && used > need)
+		used = need;
+	if ((err = bget_many(fs, bnos, used, cbs, 0)))
+		return err;
+	for (i = 0; i < used; i++) {
+		memcpy((compressed ? cbuf : out) + i * SIMPLEFS_BLOCKSIZE, cbs[i]->data, SIMPLEFS_BLOCKSIZE);
+		bput(fs, cbs[i]);
+	}
+	if (!compressed)
+		return 0;
+	memcpy(&c_len, cbuf, sizeof(c_len));
+	if (c_len > used * SIMPLEFS_BLOCKSIZE - sizeof(c_len) ||
+	    lzo1x_decompress_safe(cbuf + 4, c_len, out, &out_len, NULL) != LZO_E_OK ||
+	    out_len > bytes)
+		return -EIO;
+	memset(out + out_len, 0, SIMPLEFS_CLUSTER - out_len);
+	return 0;
+}
+
+/* the same encoding as simplefs_compr_writepage */
+static int cluster_write(struct sfs *fs, struct sfs_inode *si, uint32_t c, const unsigned char *in) {
+	static __thread unsigned char wrkmem[LZO1X_1_MEM_COMPRESS];
+	unsigned char cbuf[4 + SIMPLEFS_CLUSTER + SIMPLEFS_CLUSTER / 16 + 64 + 3];
+	uint32_t *slots = si->raw.i_data + c * SIMPLEFS_BLOCKS_PER_CLUSTER;
+	uint32_t i, used, need, bytes = cluster_bytes(si->raw.i_size, c), c_len32;
+	const unsigned char *src = in;
+	lzo_uint c_len;
+	struct cblock *cb;
+	long bno;
+
+	need = size_blocks(bytes);
+	used = need;
+	if (need && lzo1x_1_compress(in, bytes, cbuf + 4, &c_len, wrkmem) == LZO_E_OK &&
+	    size_blocks(4 + c_len) < need) {
+		c_len32 = c_len;
+		memcpy(cbuf, &c_len32, 4);
+		used = size_blocks(4 + c_len);
+		src = cbuf;
+	}
+	for (i = 0; i < cluster_slots(c); i++) {
+		bno = slots[i];
+		if (!slot_mapped(bno)) {
+			bno = 0;
+		} else if (i >= used || block_shared(fs, bno)) {
+			free_block(fs, bno);
+			bno = 0;
+		}
+		slots[i] = bno;
+		if (i >= used) {
+			if (i == used && src != in)
+				slots[i] = SIMPLEFS_COMPR_MARK;
+			continue;
+		}
+		if (!bno) {
+			if ((bno = alloc_block(fs)) < 0)
+				return bno;
+			slots[i] = bno;
+		}
+		if (!(cb = bget(fs, bno, 1)))
+			return -EIO;
+		memcpy(cb->data, src + i * SIMPLEFS_BLOCKSIZE, SIMPLEFS_BLOCKSIZE);
+		bdirty(fs, cb);
+		bput(fs, cb);
+	}
+	return 0;
+}
+
+static int compr_read(struct sfs *fs, struct sfs_inode *si, char *buf, uint32_t off, uint32_t len) {
+	unsigned char page[SIMPLEFS_CLUSTER];
+	uint32_t c, pos, chunk;
+	int err;
+
+	for (pos = off; pos < off + len; pos += chunk) {
+		c = pos / SIMPLEFS_CLUSTER;
+		chunk = SIMPLEFS_CLUSTER - pos % SIMPLEFS_CLUSTER;
+		if (chunk > off + len - pos)
+			chunk = off + len - pos;
+		if ((err = cluster_read(fs, si, c, page)))
+			return err;
+		memcpy(buf + pos - off, page + pos % SIMPLEFS_CLUSTER, chunk);
+	}
+	return 0;
+}
+
+static int compr_write(struct sfs *fs, struct sfs_inode *si, const char *buf, uint32_t off, uint32_t len) {
+	unsigned char page[SIMPLEFS_CLUSTER];
+	uint32_t c, start, end, old_size = si->raw.i_size;
+	int err;
+
+	/*
+	 * Clusters are rewritten whole. When the file grows, the old tail
+	 * cluster and any gap before the write are rewritten too, reading
+	 * back as zeroes past the old size.
+	 */
+	c = (off < old_size ? off : old_size) / SIMPLEFS_CLUSTER;
+	for (; c <= (off + len - 1) / SIMPLEFS_CLUSTER; c++) {
+		si->raw.i_size = old_size;
+		if ((err = cluster_read(fs, si, c, page)))
+			goto out;
+		start = c * SIMPLEFS_CLUSTER;
+		end = start + SIMPLEFS_CLUSTER;
+		if (start < off)
+			start = off;
+		if (end > off + len)
+			end = off + len;
+		if (start < end)
+			memcpy(page + start % SIMPLEFS_CLUSTER, buf + start - off, end - start);
+		if (off + len > old_size)
+			si->raw.i_size = off + len;
+		if ((err = cluster_write(fs, si, c, page)))
+			goto out;
+	}
+	return 0;
+ out:
+	si->raw.i_size = old_size;
+	return err;
+}
+
+static int file_read(struct sfs *fs, struct sfs_inode *si, char *buf, uint32_t off, uint32_t len) {
+	return is_compr(si) ? compr_read(fs, si, buf, off, len) : plain_read(fs, si, buf, off, len);
+}
+
+static int file_write(struct sfs *fs, struct sfs_inode *si, const char *buf, uint32_t off, uint32_t len) {
+	int err;
+
+	if ((uint64_t)off + len > SIMPLEFS_MAX_SIZE)
+		return -EFBIG;
+	if (!len)
+		return 0;
+	err = is_compr(si) ? compr_write(fs, si, buf, off, len) : plain_write(fs, si, buf, off, len);
+	touch(si);
+	iwrite(fs, si);
+	return err;
+}
+
+static void free_slots(struct sfs *fs, struct sfs_inode *si, uint32_t from) {
+	uint32_t i;
+
+	for (i = from; i < SIMPLEFS_BLOCKS_PER_INODE; i++) {
+		if (slot_mapped(si->raw.i_data[i]))
+			free_block(fs, si->raw.i_data[i]);
+		si->raw.i_data[i] = 0;
+	}
+}
+
+static int file_truncate(struct sfs *fs, struct sfs_inode *si, uint32_t size) {
+	unsigned char page[SIMPLEFS_CLUSTER];
+	char zero[SIMPLEFS_MAX_SIZE];
+	uint32_t c;
+	int err;
+
+	if (size > SIMPLEFS_MAX_SIZE)
+		return -EFBIG;
+	if (size > si->raw.i_size) {
+		memset(zero, 0, size - si->raw.i_size);
+		return file_write(fs, si, zero, si->raw.i_size, size - si->raw.i_size);
+	}
+	if (!is_compr(si)) {
+		free_slots(fs, si, size_blocks(size));
+	} else {
+		c = size / SIMPLEFS_CLUSTER;
+		if (size % SIMPLEFS_CLUSTER) {
+			if ((err = cluster_read(fs, si, c, page)))
+				return err;
+			memset(page + size % SIMPLEFS_CLUSTER, 0, SIMPLEFS_CLUSTER - size % SIMPLEFS_CLUSTER);
+			si->raw.i_size = size;
+			if ((err = cluster_write(fs, si, c, page)))
+				return err;
+			c++;
+		}
+		free_slots(fs, si, c * SIMPLEFS_BLOCKS_PER_CLUSTER);
+	}
+	si->raw.i_size = size;
+	touch(si);
+	return iwrite(fs, si);
+}
+
+/* release an inode nobody refers to any more */
+static void inode_free(struct sfs *fs, struct sfs_inode *si) {
+	free_slots(fs, si, 0);
+	si->raw.i_size = 0;
+	iwrite(fs, si);
+	bitmap_free(fs, 0, si->ino);
+	fs->free_inodes++;
+}
+
+static void maybe_free(struct sfs *fs, struct sfs_inode *si) {
+	if (!si->raw.i_nlink && !si->nlookup && !si->nopen)
+		inode_free(fs, si);
+}
+
+/*
+ * Free the inodes the kernel module left on the orphan list. Ours are
+ * freed as soon as nothing refers to them and never go on the list.
+ */
+static int orphan_replay(struct sfs *fs) {
+	struct sfs_inode *si;
+	struct cblock *cb;
+	uint32_t *slots;
+	unsigned i;
+	int err = 0;
+
+	/* older images have no list, just what was on the device */
+	if (fs->sb.s_orphan_magic != SIMPLEFS_ORPHAN_MAGIC)
+		return 0;
+	if (!(cb = bget(fs, SIMPLEFS_SUPER_BNO, 0)))
+		return -EIO;
+	slots = (uint32_t *)(cb->data + SIMPLEFS_ORPHAN_OFFSET);
+	for (i = 0; i < SIMPLEFS_ORPHANS; i++) {
+		if (!slots[i] || slots[i] == SIMPLEFS_ROOT_INO || slots[i] >= fs->ninodes)
+			continue;
+		if ((err = iget(fs, slots[i], &si)))
+			break;
+		si->raw.i_nlink = 0;
+		inode_free(fs, si);
+		iput(fs, si);
+		slots[i] = 0;
+		bdirty(fs, cb);
+	}
+	bput(fs, cb);
+	return err;
+}
+
+
+/*
+ * Directories
+ */
+
+static int dir_find(struct sfs *fs, struct sfs_inode *dir, const char *name,
+		    uint32_t *pos, uint32_t *ino) {
+	char buf[SIMPLEFS_MAX_SIZE];
+	struct simplefs_dentry *de;
+	size_t len = strlen(name);
+	uint32_t p;
+	int err;
+
+	if (len > SIMPLEFS_NAME_LEN)
+		return -ENAMETOOLONG;
+	if ((err = file_read(fs, dir, buf, 0, dir->raw.i_size)))
+		return err;
+	for (p = 0; p + SIMPLEFS_DENTRY_SIZE <= dir->raw.i_size; p += SIMPLEFS_DENTRY_SIZE) {
+		de = (struct simplefs_dentry *)(buf + p);
+		if (de->flags == SIMPLEFS_DENTRY_UNUSED)
+			continue;
+		if (strnlen(de->name, SIMPLEFS_NAME_LEN) == len && !memcmp(de->name, name, len)) {
+			*pos = p;
+			*ino = de->inode;
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static int dir_add(struct sfs *fs, struct sfs_inode *dir, const char *name, uint32_t ino) {
+	struct simplefs_dentry de;
+	size_t len = strlen(name);
+
+	if (len > SIMPLEFS_NAME_LEN)
+		return -ENAMETOOLONG;
+	memset(&de, 0, sizeof(de));
+	de.inode = ino;
+	de.flags = SIMPLEFS_DENTRY_INUSED;
+	memcpy(de.name, name, len);
+	return file_write(fs, dir, (char *)&de, dir->raw.i_size, sizeof(de));
+}
+
+static int dir_remove(struct sfs *fs, struct sfs_inode *dir, uint32_t pos) {
+	uint32_t flags = SIMPLEFS_DENTRY_UNUSED;
+
+	return file_write(fs, dir, (char *)&flags, pos + offsetof(struct simplefs_dentry, flags),
+			  sizeof(flags));
+}
+
+static int dir_empty(struct sfs *fs, struct sfs_inode *dir) {
+	char buf[SIMPLEFS_MAX_SIZE];
+	struct simplefs_dentry *de;
+	uint32_t p;
+
+	if (file_read(fs, dir, buf, 0, dir->raw.i_size))
+		return 0;
+	for (p = 0; p + SIMPLEFS_DENTRY_SIZE <= dir->raw.i_size; p += SIMPLEFS_DENTRY_SIZE) {
+		de = (struct simplefs_dentry *)(buf + p);
+		if (de->flags != SIMPLEFS_DENTRY_UNUSED)
+			return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * FUSE operations
+ */
+
+static struct sfs *req_fs(fuse_req_t req) {
+	return fuse_req_userdata(req);
+}
+
+static uint32_t to_ino(fuse_ino_t ino) {
+	return ino - FUSE_ROOT_ID;
+}
+
+static void reply_entry(fuse_req_t req, struct sfs *fs, struct sfs_inode *si) {
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(e));
+	e.ino = si->ino + FUSE_ROOT_ID;
+	e.attr_timeout = e.entry_timeout = fs->timeout;
+	stat_inode(si, &e.attr);
+	pthread_mutex_lock(&fs->ic.lock);
+	si->nlookup++;
+	pthread_mutex_unlock(&fs->ic.lock);
+	fuse_reply_entry(req, &e);
+}
+
+static void sfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *dir, *si;
+	uint32_t pos, ino;
+	int err;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	if (!(err = iget(fs, to_ino(parent), &dir))) {
+		if (!(err = dir_find(fs, dir, name, &pos, &ino)) && !(err = iget(fs, ino, &si))) {
+			reply_entry(req, fs, si);
+			iput(fs, si);
+		}
+		iput(fs, dir);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+}
+
+static void forget_one(struct sfs *fs, fuse_ino_t ino, uint64_t nlookup) {
+	struct sfs_inode *si;
+
+	if (iget(fs, to_ino(ino), &si))
+		return;
+	si->nlookup = si->nlookup > nlookup ? si->nlookup - nlookup : 0;
+	maybe_free(fs, si);
+	iput(fs, si);
+}
+
+static void sfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	struct sfs *fs = req_fs(req);
+
+	pthread_rwlock_wrlock(&fs->lock);
+	forget_one(fs, ino, nlookup);
+	pthread_rwlock_unlock(&fs->lock);
+	fuse_reply_none(req);
+}
+
+static void sfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+	struct sfs *fs = req_fs(req);
+	size_t i;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	for (i = 0; i < count; i++)
+		forget_one(fs, forgets[i].ino, forgets[i].nlookup);
+	pthread_rwlock_unlock(&fs->lock);
+	fuse_reply_none(req);
+}
+
+static void sfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *si;
+	struct stat st;
+	int err;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	if (!(err = iget(fs, to_ino(ino), &si))) {
+		stat_inode(si, &st);
+		iput(fs, si);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &st, fs->timeout);
+}
+
+/* uid and gid are not stored on disk and can't be changed */
+static void sfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int to_set, struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *si;
+	struct stat st;
+	int err;
+
+	if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	pthread_rwlock_wrlock(&fs->lock);
+	if ((err = iget(fs, to_ino(ino), &si)))
+		goto out;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		if (S_ISDIR(si->raw.i_mode))
+			err = -EISDIR;
+		else
+			err = file_truncate(fs, si, attr->st_size);
+	}
+	if (!err && (to_set & FUSE_SET_ATTR_MODE))
+		si->raw.i_mode = (si->raw.i_mode & ~07777) | (attr->st_mode & 07777);
+	if (!err && (to_set & FUSE_SET_ATTR_MTIME))
+		si->raw.i_time = attr->st_mtime;
+	if (!err && (to_set & FUSE_SET_ATTR_MTIME_NOW))
+		touch(si);
+	if (!err)
+		err = iwrite(fs, si);
+	stat_inode(si, &st);
+	iput(fs, si);
+	bbalance(fs);
+ out:
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &st, fs->timeout);
+}
+
+/*
+ * Allocate and link a new inode. New files and directories inherit
+ * the compression flag from their parent, as simplefs_create does.
+ */
+static int make_node(struct sfs *fs, struct sfs_inode *dir, const char *name, mode_t mode,
+		     struct sfs_inode **out) {
+	struct sfs_inode *si;
+	uint32_t pos, ino;
+	long nr;
+	int err;
+
+	if (strlen(name) > SIMPLEFS_NAME_LEN)
+		return -ENAMETOOLONG;
+	if (dir_find(fs, dir, name, &pos, &ino) == 0)
+		return -EEXIST;
+	if ((nr = bitmap_alloc(fs, 0, fs->ninodes, &fs->ino_hint)) < 0)
+		return nr;
+	fs->free_inodes--;
+	if ((err = iget(fs, nr, &si))) {
+		bitmap_free(fs, 0, nr);
+		fs->free_inodes++;
+		return err;
+	}
+	memset(&si->raw, 0, sizeof(si->raw));
+	si->raw.i_mode = mode | (dir->raw.i_mode & (SIMPLEFS_INODE_COMPR << SIMPLEFS_FLAGS_SHIFT));
+	si->raw.i_nlink = S_ISDIR(mode) ? 2 : 1;
+	touch(si);
+	if ((err = iwrite(fs, si)) || (err = dir_add(fs, dir, name, si->ino))) {
+		si->raw.i_nlink = 0;
+		inode_free(fs, si);
+		iput(fs, si);
+		return err;
+	}
+	if (S_ISDIR(mode)) {
+		dir->raw.i_nlink++;
+		iwrite(fs, dir);
+	}
+	*out = si;
+	return 0;
+}
+
+static void do_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		      struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *dir, *si;
+	struct fuse_entry_param e;
+	int err;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if ((err = iget(fs, to_ino(parent), &dir)))
+		goto out;
+	if (!(err = make_node(fs, dir, name, mode, &si))) {
+		memset(&e, 0, sizeof(e));
+		e.ino = si->ino + FUSE_ROOT_ID;
+		e.attr_timeout = e.entry_timeout = fs->timeout;
+		stat_inode(si, &e.attr);
+		si->nlookup++;
+		if (fi)
+			si->nopen++;
+		iput(fs, si);
+	}
+	iput(fs, dir);
+	bbalance(fs);
+ out:
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else if (fi)
+		fuse_reply_create(req, &e, fi);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+		       struct fuse_file_info *fi) {
+	do_create(req, parent, name, (mode & 07777) | S_IFREG, fi);
+}
+
+static void sfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev) {
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	do_create(req, parent, name, mode, NULL);
+}
+
+static void sfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	do_create(req, parent, name, (mode & 07777) | S_IFDIR, NULL);
+}
+
+static int do_unlink(struct sfs *fs, struct sfs_inode *dir, const char *name, int isdir) {
+	struct sfs_inode *si;
+	uint32_t pos, ino;
+	int err;
+
+	if ((err = dir_find(fs, dir, name, &pos, &ino)) || (err = iget(fs, ino, &si)))
+		return err;
+	if (isdir && !S_ISDIR(si->raw.i_mode))
+		err = -ENOTDIR;
+	else if (!isdir && S_ISDIR(si->raw.i_mode))
+		err = -EISDIR;
+	else if (isdir && !dir_empty(fs, si))
+		err = -ENOTEMPTY;
+	else if (!(err = dir_remove(fs, dir, pos))) {
+		if (isdir) {
+			si->raw.i_nlink = 0;
+			dir->raw.i_nlink--;
+			iwrite(fs, dir);
+		} else {
+			si->raw.i_nlink--;
+		}
+		iwrite(fs, si);
+		maybe_free(fs, si);
+	}
+	iput(fs, si);
+	return err;
+}
+
+static void unlink_common(fuse_req_t req, fuse_ino_t parent, const char *name, int isdir) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *dir;
+	int err;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if (!(err = iget(fs, to_ino(parent), &dir))) {
+		err = do_unlink(fs, dir, name, isdir);
+		iput(fs, dir);
+	}
+	bbalance(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	fuse_reply_err(req, -err);
+}
+
+static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	unlink_common(req, parent, name, 0);
+}
+
+static void sfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	unlink_common(req, parent, name, 1);
+}
+
+static void sfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *dir = NULL, *si = NULL;
+	struct fuse_entry_param e;
+	uint32_t pos, other;
+	int err;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if ((err = iget(fs, to_ino(newparent), &dir)) || (err = iget(fs, to_ino(ino), &si)))
+		goto out;
+	if (S_ISDIR(si->raw.i_mode))
+		err = -EPERM;
+	else if (dir_find(fs, dir, newname, &pos, &other) == 0)
+		err = -EEXIST;
+	else if (!(err = dir_add(fs, dir, newname, si->ino))) {
+		si->raw.i_nlink++;
+		iwrite(fs, si);
+		memset(&e, 0, sizeof(e));
+		e.ino = ino;
+		e.attr_timeout = e.entry_timeout = fs->timeout;
+		stat_inode(si, &e.attr);
+		si->nlookup++;
+	}
+ out:
+	if (si)
+		iput(fs, si);
+	if (dir)
+		iput(fs, dir);
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+/*
+ * The kernel module has no rename. Here it is a link into the new
+ * directory followed by removing the old entry, replacing a target
+ * of the same kind.
+ */
+static void sfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		       fuse_ino_t newparent, const char *newname, unsigned int flags) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *dir = NULL, *newdir = NULL, *si = NULL;
+	uint32_t pos, newpos, ino, target;
+	int err;
+
+	if (flags) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	pthread_rwlock_wrlock(&fs->lock);
+	if ((err = iget(fs, to_ino(parent), &dir)) || (err = iget(fs, to_ino(newparent), &newdir)))
+		goto out;
+	if ((err = dir_find(fs, dir, name, &pos, &ino)) || (err = iget(fs, ino, &si)))
+		goto out;
+	if (strlen(newname) > SIMPLEFS_NAME_LEN) {
+		err = -ENAMETOOLONG;
+		goto out;
+	}
+	if (dir_find(fs, newdir, newname, &newpos, &target) == 0) {
+		if (target == ino)
+			goto out;
+		if ((err = do_unlink(fs, newdir, newname, S_ISDIR(si->raw.i_mode))))
+			goto out;
+	}
+	if ((err = dir_add(fs, newdir, newname, ino)) || (err = dir_remove(fs, dir, pos)))
+		goto out;
+	if (S_ISDIR(si->raw.i_mode) && dir != newdir) {
+		dir->raw.i_nlink--;
+		newdir->raw.i_nlink++;
+		iwrite(fs, dir);
+		iwrite(fs, newdir);
+	}
+ out:
+	if (si)
+		iput(fs, si);
+	if (newdir)
+		iput(fs, newdir);
+	if (dir)
+		iput(fs, dir);
+	bbalance(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	fuse_reply_err(req, -err);
+}
+
+static void sfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *si;
+	int err;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if (!(err = iget(fs, to_ino(ino), &si))) {
+		if (fi->flags & O_TRUNC)
+			err = file_truncate(fs, si, 0);
+		if (!err)
+			si->nopen++;
+		iput(fs, si);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_open(req, fi);
+}
+
+static void sfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *si;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if (!iget(fs, to_ino(ino), &si)) {
+		if (si->nopen)
+			si->nopen--;
+		maybe_free(fs, si);
+		iput(fs, si);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	fuse_reply_err(req, 0);
+}
+
+static void sfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+		     struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	char buf[SIMPLEFS_MAX_SIZE];
+	struct sfs_inode *si;
+	int err;
+
+	pthread_rwlock_rdlock(&fs->lock);
+	if (!(err = iget(fs, to_ino(ino), &si))) {
+		if ((uint64_t)off >= si->raw.i_size)
+			size = 0;
+		else if (off + size > si->raw.i_size)
+			size = si->raw.i_size - off;
+		if (size)
+			err = file_read(fs, si, buf, off, size);
+		iput(fs, si);
+	}
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_buf(req, buf, size);
+}
+
+static void sfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+		      off_t off, struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	struct sfs_inode *si;
+	int err;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if (!(err = iget(fs, to_ino(ino), &si))) {
+		if (fi->flags & O_APPEND)
+			off = si->raw.i_size;
+		err = file_write(fs, si, buf, off, size);
+		iput(fs, si);
+	}
+	bbalance(fs);
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_write(req, size);
+}
+
+static void sfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	int err;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	err = bflush(fs, 1);
+	pthread_rwlock_unlock(&fs->lock);
+	fuse_reply_err(req, -err);
+}
+
+static void sfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			struct fuse_file_info *fi) {
+	struct sfs *fs = req_fs(req);
+	char data[SIMPLEFS_MAX_SIZE], name[SIMPLEFS_NAME_LEN + 1];
+	struct simplefs_dentry *de;
+	struct sfs_inode *dir;
+	struct stat st;
+	size_t used = 0, len;
+	uint32_t p;
+	char *buf;
+	int err;
+
+	if (!(buf = malloc(size))) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_rwlock_rdlock(&fs->lock);
+	if ((err = iget(fs, to_ino(ino), &dir)))
+		goto out;
+	if ((err = file_read(fs, dir, data, 0, dir->raw.i_size)))
+		goto put;
+	memset(&st, 0, sizeof(st));
+	/* offsets are dentry numbers plus one, so 0 means the start */
+	for (p = off * SIMPLEFS_DENTRY_SIZE; p + SIMPLEFS_DENTRY_SIZE <= dir->raw.i_size;
+	     p += SIMPLEFS_DENTRY_SIZE) {
+		de = (struct simplefs_dentry *)(data + p);
+		if (de->flags == SIMPLEFS_DENTRY_UNUSED)
+			continue;
+		memcpy(name, de->name, SIMPLEFS_NAME_LEN);
+		name[SIMPLEFS_NAME_LEN] = 0;
+		st.st_ino = de->inode + FUSE_ROOT_ID;
+		len = fuse_add_direntry(req, buf + used, size - used, name, &st,
+					p / SIMPLEFS_DENTRY_SIZE + 1);
+		if (len > size - used)
+			break;
+		used += len;
+	}
+ put:
+	iput(fs, dir);
+ out:
+	pthread_rwlock_unlock(&fs->lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void sfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct sfs *fs = req_fs(req);
+	struct statvfs st;
+
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = st.f_frsize = SIMPLEFS_BLOCKSIZE;
+	st.f_blocks = fs->nblocks;
+	st.f_bfree = st.f_bavail = fs->free_blocks;
+	st.f_files = fs->ninodes;
+	st.f_ffree = st.f_favail = fs->free_inodes;
+	st.f_namemax = SIMPLEFS_NAME_LEN;
+	fuse_reply_statfs(req, &st);
+}
+
+static void sfs_destroy(void *userdata) {
+	struct sfs *fs = userdata;
+
+	pthread_rwlock_wrlock(&fs->lock);
+	if (bflush(fs, 1))
+		fprintf(stderr, "simplefs: write back failed on unmount\n");
+	pthread_rwlock_unlock(&fs->lock);
+}
+
+static const struct fuse_lowlevel_ops sfs_ops = {
+	.destroy = sfs_destroy,
+	.lookup = sfs_lookup,
+	.forget = sfs_forget,
+	.forget_multi = sfs_forget_multi,
+	.getattr = sfs_getattr,
+	.setattr = sfs_setattr,
+	.mknod = sfs_mknod,
+	.mkdir = sfs_mkdir,
+	.unlink = sfs_unlink,
+	.rmdir = sfs_rmdir,
+	.rename = sfs_rename,
+	.link = sfs_link,
+	.open = sfs_open,
+	.read = sfs_read,
+	.write = sfs_write,
+	.release = sfs_release,
+	.fsync = sfs_fsync,
+	.opendir = sfs_open,
+	.readdir = sfs_readdir,
+	.releasedir = sfs_release,
+	.fsyncdir = sfs_fsync,
+	.statfs = sfs_statfs,
+	.create = sfs_create,
+};
+
+
+/*
+ * Setup
+ */
+
+/* count free bits in one batch read of the whole bitmap */
+static int count_free(struct sfs *fs, int block_bitmap, uint32_t total, uint32_t *out) {
+	uint32_t nblk = (total + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK, i, nr;
+	struct cblock **cbs;
+	uint64_t *bnos;
+	int err = -ENOMEM;
+
+	cbs = malloc(nblk * sizeof(*cbs));
+	bnos = malloc(nblk * sizeof(*bnos));
+	if (!cbs || !bnos)
+		goto out;
+	for (i = 0; i < nblk; i++)
+		bnos[i] = bitmap_bno(fs, block_bitmap, i * BITS_PER_BLOCK);
+	if ((err = bget_many(fs, bnos, nblk, cbs, 0)))
+		goto out;
+	for (*out = 0, nr = 0; nr < total; nr++) {
+		if (!bit_test(cbs[nr / BITS_PER_BLOCK], nr))
+			(*out)++;
+	}
+	for (i = 0; i < nblk; i++)
+		bput(fs, cbs[i]);
+ out:
+	free(cbs);
+	free(bnos);
+	return err;
+}
+
+static int sfs_open_image(struct sfs *fs, const char *image, size_t cache_blocks) {
+	struct bcache *bc = &fs->bc;
+	struct simplefs_inode root;
+	unsigned char block[SIMPLEFS_BLOCKSIZE];
+	int err;
+
+	if ((fs->fd = open(image, O_RDWR)) < 0) {
+		perror(image);
+		return -1;
+	}
+	if (pread(fs->fd, block, sizeof(block), SIMPLEFS_SUPER_BNO << SIMPLEFS_BLOCKBITS) != sizeof(block)) {
+		fprintf(stderr, "%s: can't read the superblock\n", image);
+		return -1;
+	}
+	memcpy(&fs->sb, block, sizeof(fs->sb));
+	fs->inode_start = SIMPLEFS_BITMAP_BNO + fs->sb.s_inode_bitmap_blknr + fs->sb.s_block_bitmap_blknr;
+	fs->refcount_start = fs->inode_start + fs->sb.s_inode_blknr;
+	fs->data_start = fs->refcount_start + fs->sb.s_refcount_blknr;
+	fs->ninodes = fs->sb.s_inode_blknr * SIMPLEFS_INODES_PER_BLOCK;
+	if (fs->ninodes > fs->sb.s_inode_bitmap_blknr * BITS_PER_BLOCK)
+		fs->ninodes = fs->sb.s_inode_bitmap_blknr * BITS_PER_BLOCK;
+	fs->nblocks = fs->sb.s_block_bitmap_blknr * BITS_PER_BLOCK;
+	if (!fs->ninodes || !fs->nblocks) {
+		fprintf(stderr, "%s: not a simplefs image\n", image);
+		return -1;
+	}
+	if (fs->sb.s_nr_devices > 1) {
+		fprintf(stderr, "%s: striped over %u devices, which is not supported here\n",
+			image, fs->sb.s_nr_devices);
+		return -1;
+	}
+
+	pthread_rwlock_init(&fs->lock, NULL);
+	pthread_mutex_init(&bc->lock, NULL);
+	pthread_cond_init(&bc->loaded, NULL);
+	pthread_mutex_init(&fs->ic.lock, NULL);
+	bc->lru.next = bc->lru.prev = &bc->lru;
+	bc->max = cache_blocks;
+	bc->hash_size = cache_blocks / 4 + 1;
+	fs->ic.max = cache_blocks / 8 + 64;
+	if (!(bc->hash = calloc(bc->hash_size, sizeof(*bc->hash))))
+		return -1;
+
+	if ((err = count_free(fs, 0, fs->ninodes, &fs->free_inodes)) ||
+	    (err = count_free(fs, 1, fs->nblocks, &fs->free_blocks)) ||
+	    (err = orphan_replay(fs)) ||
+	    (err = raw_read(fs, SIMPLEFS_ROOT_INO, &root))) {
+		fprintf(stderr, "%s: %s\n", image, strerror(-err));
+		return -1;
+	}
+	if (!S_ISDIR(root.i_mode)) {
+		fprintf(stderr, "%s: corrupt root inode\n", image);
+		return -1;
+	}
+	return 0;
+}
+
+struct sfs_config {
+	char *image;
+	size_t cache;
+};
+
+static const struct fuse_opt sfs_opts[] = {
+	{ "image=%s", offsetof(struct sfs_config, image), 0 },
+	{ "cache=%lu", offsetof(struct sfs_config, cache), 0 },
+	FUSE_OPT_END
+};
+
+static void usage(const char *prog) {
+	printf("usage: %s [options] <mountpoint>\n\n"
+	       "    -o image=FILE    simplefs image or device to serve\n"
+	       "    -o cache=N       block cache size in 512 byte blocks (default 65536)\n\n",
+	       prog);
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+}
+
+int main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct sfs_config conf = { NULL, 65536 };
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+	struct sfs fs;
+	int ret = 1;
+
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
+	if (opts.show_help) {
+		usage(argv[0]);
+		goto out_args;
+	}
+	if (opts.show_version) {
+		fuse_lowlevel_version();
+		ret = 0;
+		goto out_args;
+	}
+	if (fuse_opt_parse(&args, &conf, sfs_opts, NULL) == -1)
+		goto out_args;
+	if (!opts.mountpoint || !conf.image) {
+		usage(argv[0]);
+		goto out_args;
+	}
+	if (lzo_init() != LZO_E_OK) {
+		fprintf(stderr, "lzo_init failed\n");
+		goto out_args;
+	}
+
+	memset(&fs, 0, sizeof(fs));
+	fs.timeout = 1.0;
+	pthread_key_create(&ring_key, ring_free);
+	if (sfs_open_image(&fs, conf.image, conf.cache < 64 ? 64 : conf.cache))
+		goto out_args;
+
+	if (!(se = fuse_session_new(&args, &sfs_ops, sizeof(sfs_ops), &fs)))
+		goto out_args;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_session;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread)
+		ret = fuse_session_loop(se);
+	else
+		ret = fuse_session_loop_mt(se, opts.clone_fd);
+	fuse_session_unmount(se);
+ out_signals:
+	fuse_remove_signal_handlers(se);
+ out_session:
+	fuse_session_destroy(se);
+ out_args:
+	free(opts.mountpoint);
+	fuse_opt_free_args(&args);
+	return ret ? 1 : 0;
+}
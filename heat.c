@@ -0,0 +1,87 @@
+/*
+ * linux/fs/sfs/heat.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include "simplefs.h"
+
+/*
+ * Reads and writes through the file operations count towards the heat
+ * of the in-memory inode. Both counters are halved every
+ * SIMPLEFS_HEAT_HALFLIFE, so a file stays hot only while it is used.
+ * Hot files get their blocks from the hot region at the start of the
+ * data area, the others after it, and defrag moves a file into the
+ * region it belongs in. Heat is not kept on disk.
+ */
+
+#define SIMPLEFS_HEAT_HALFLIFE (60 * HZ)
+#define SIMPLEFS_HEAT_HOT 64		/* reads + writes */
+#define SIMPLEFS_HOT_PERCENT 10		/* of the data blocks */
+
+/* called with i_lock held */
+static void simplefs_heat_decay(struct simplefs_inode_info *si) {
+	unsigned long halves = (jiffies - si->i_heat_stamp) / SIMPLEFS_HEAT_HALFLIFE;
+
+	if (!halves)
+		return;
+	si->i_heat_stamp += halves * SIMPLEFS_HEAT_HALFLIFE;
+	if (halves >= 32) {
+		si->i_heat_reads = si->i_heat_writes = 0;
+		return;
+	}
+	si->i_heat_reads >>= halves;
+	si->i_heat_writes >>= halves;
+}
+
+void simplefs_heat_touch(struct inode *inode, int write) {
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+	unsigned *counter = write ? &si->i_heat_writes : &si->i_heat_reads;
+
+	spin_lock(&inode->i_lock);
+	simplefs_heat_decay(si);
+	if (*counter < UINT_MAX)
+		(*counter)++;
+	spin_unlock(&inode->i_lock);
+}
+
+void simplefs_heat_get(struct inode *inode, struct simplefs_heat *heat) {
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+
+	spin_lock(&inode->i_lock);
+	simplefs_heat_decay(si);
+	heat->h_reads = si->i_heat_reads;
+	heat->h_writes = si->i_heat_writes;
+	spin_unlock(&inode->i_lock);
+	heat->h_hot = heat->h_reads + heat->h_writes >= SIMPLEFS_HEAT_HOT;
+}
+
+static int simplefs_inode_hot(struct inode *inode) {
+	struct simplefs_heat heat;
+
+	simplefs_heat_get(inode, &heat);
+	return heat.h_hot;
+}
+
+/* first data block after the hot region, counted from the data area */
+static long simplefs_cold_start(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+
+	return (long)sbi->raw_super.s_block_blknr * SIMPLEFS_HOT_PERCENT / 100;
+}
+
+/* where simplefs_reserve_block should look for blocks of this inode */
+long simplefs_alloc_goal(struct inode *inode) {
+	return simplefs_inode_hot(inode) ? 0 : simplefs_cold_start(inode->i_sb);
+}
+
+/* whether data block bno is in the region the inode's heat calls for */
+int simplefs_heat_placed(struct inode *inode, long bno) {
+	struct simplefs_super_info *sbi = inode->i_sb->s_fs_info;
+	int hot = bno - bitmap_data_start(sbi) < simplefs_cold_start(inode->i_sb);
+
+	return hot == simplefs_inode_hot(inode);
+}
@@ -1,21 +1,27 @@
 #include <linux/buffer_head.h>
 #include <linux/writeback.h>
+#include <linux/highmem.h>
 #include <asm/ptrace.h>
 #include "simplefs.h"
 
+/* the inode table block holding an inode */
+static sector_t simplefs_inode_block(struct simplefs_super_info *sbi, long ino) {
+	return ino / SIMPLEFS_INODES_PER_BLOCK + sbi->raw_super.s_inode_bitmap_blknr
+		+ sbi->raw_super.s_block_bitmap_blknr + 1;
+}
+
 struct simplefs_inode *simplefs_iget_raw(struct super_block *sb, long ino,
 					 struct buffer_head **bh) {
 	struct simplefs_super_info *sbi = sb->s_fs_info;
-	int block, bitmap_blocks;
+	sector_t block;
 	struct simplefs_inode *raw_inode;
 	printk(KERN_INFO "simplefs_iget_raw\n");	
 	if (ino >= sbi->raw_super.s_inode_blknr * SIMPLEFS_INODES_PER_BLOCK) {
 		printk(KERN_ERR "Bad inode number on dev %s: %ld is out of range\n", sb->s_id, (long) ino);
 		return NULL;
 	}
-	bitmap_blocks = sbi->raw_super.s_inode_bitmap_blknr + sbi->raw_super.s_block_bitmap_blknr;
-	block = ino / SIMPLEFS_INODES_PER_BLOCK + bitmap_blocks + 1;
-	printk(KERN_INFO "simplefs_iget_raw->sb_bread: %d\n", block);
+	block = simplefs_inode_block(sbi, ino);
+	printk(KERN_INFO "simplefs_iget_raw->sb_bread: %llu\n", (unsigned long long)block);
 	if (!(*bh = sb_bread(sb, block)))
 		return NULL;
 	raw_inode = (struct simplefs_inode *)(*bh)->b_data + ino % SIMPLEFS_INODES_PER_BLOCK;
@@ -24,8 +30,49 @@ struct simplefs_inode *simplefs_iget_raw(struct super_block *sb, long ino,
 }
 
 
+/*
+ * Set up the in-memory inode for a number just taken from the inode
+ * bitmap. Nothing on disk is worth reading: a free inode has no
+ * blocks, and everything else is written by write_inode. The inode
+ * table block is only read ahead, for that write. The inode is
+ * returned locked and new, like from iget_locked: the caller sets the
+ * mode, flags and link count, then calls unlock_new_inode.
+ */
 struct inode *simplefs_inew(struct super_block *sb, long ino) {
-	return NULL;
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct inode *inode;
+
+	if (ino >= sbi->raw_super.s_inode_blknr * SIMPLEFS_INODES_PER_BLOCK) {
+		printk(KERN_ERR "Bad inode number on dev %s: %ld is out of range
+", sb->s_id, ino);
+		return NULL;
+	}
+	if (!(inode = iget_locked(sb, ino)))
+		return NULL;
+	if (!(inode->i_state & I_NEW)) {
+		printk(KERN_ERR "simplefs_inew: free inode %ld is still in use\n", ino);
+		iput(inode);
+		return NULL;
+	}
+	sb_breadahead(sb, simplefs_inode_block(sbi, ino));
+	inode->i_size = inode->i_blocks = inode->i_bytes = 0;
+	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
+	return inode;
+}
+
+void simplefs_set_inode_ops(struct inode *inode) {
+	if (S_ISREG(inode->i_mode)) {
+		inode->i_op = &simplefs_file_inode_operations;
+		inode->i_fop = &simplefs_file_operations;
+		if (SIMPLEFS_I(inode)->i_flags & SIMPLEFS_INODE_COMPR)
+			inode->i_mapping->a_ops = &simplefs_compr_aops;
+		else
+			inode->i_mapping->a_ops = &simplefs_aops;
+	} else if (S_ISDIR(inode->i_mode)) {
+		inode->i_op = &simplefs_dir_inode_operations;
+		inode->i_fop = &simplefs_dir_operations;
+		inode->i_mapping->a_ops = &simplefs_aops;
+	}
 }
 
 
@@ -54,6 +101,10 @@ struct inode *simplefs_iget(struct super_block *sb, long ino) {
 	printk("simplefs_iget raw_inode info: %ld -> %d %d %d %d", ino, raw_inode->i_mode,
 	       raw_inode->i_nlink, raw_inode->i_size, raw_inode->i_time);
 	inode->i_mode = raw_inode->i_mode;
+	SIMPLEFS_I(inode)->i_flags = raw_inode->i_mode >> SIMPLEFS_FLAGS_SHIFT;
+	SIMPLEFS_I(inode)->i_disk_mode = raw_inode->i_mode;
+	SIMPLEFS_I(inode)->i_disk_nlink = raw_inode->i_nlink;
+	SIMPLEFS_I(inode)->i_disk_size = raw_inode->i_size;
 	inode->i_nlink = raw_inode->i_nlink;
 	inode->i_size = raw_inode->i_size;
 	inode->i_blocks = inode->i_size >> SIMPLEFS_BLOCKBITS;
@@ -63,17 +114,7 @@ struct inode *simplefs_iget(struct super_block *sb, long ino) {
 	inode->i_ctime.tv_nsec = 0;
 	inode->i_atime.tv_nsec = 0;
 
-	// set inode operations
-	if (S_ISREG(inode->i_mode)) {
-		inode->i_op = &simplefs_file_inode_operations;
-		inode->i_fop = &simplefs_file_operations;
-		inode->i_mapping->a_ops = &simplefs_aops;
-	} else if (S_ISDIR(inode->i_mode)) {
-		inode->i_op = &simplefs_dir_inode_operations;
-		inode->i_fop = &simplefs_dir_operations;
-		inode->i_mapping->a_ops = &simplefs_aops;
-	}
-
+	simplefs_set_inode_ops(inode);
 	brelse(bh);
 	unlock_new_inode(inode);
 	return inode;
@@ -90,13 +131,18 @@ void simplefs_truncate(struct inode *inode) {
 	int i, blocks;
 
 	printk(KERN_INFO "simplefs_truncate start: %ld\n", inode->i_ino);
-	blocks = (inode->i_size + SIMPLEFS_BLOCKSIZE - 1) >> (SIMPLEFS_BLOCKBITS);
+	blocks = inode_slots(inode);
 	if (!(raw_inode = simplefs_iget_raw(inode->i_sb, inode->i_ino, &bh))) {
 		printk(KERN_ERR "simplefs_truncate failed: %ld\n", inode->i_ino);
 		return;
 	}
 	for (i = 0; i < blocks; i++) {
+		if (!slot_mapped(raw_inode->i_data[i])) {
+			raw_inode->i_data[i] = 0;
+			continue;
+		}
 		bitmap_free_block(inode->i_sb, raw_inode->i_data[i]);
+		raw_inode->i_data[i] = 0;
 	}
 	inode->i_size = inode->i_blocks = inode->i_bytes = 0;
 	raw_inode->i_size = 0;
@@ -109,13 +155,6 @@ void simplefs_truncate(struct inode *inode) {
 }
 
 
-int simplefs_free_inode(struct inode *inode) {
-	bitmap_free_inode(inode->i_sb, inode->i_ino);
-	printk(KERN_INFO "simplefs_free_inode ok: %ld\n", inode->i_ino);
-	clear_inode(inode);
-	return 0;
-}
-
 int simplefs_sync_inode(struct inode *inode) {
 	struct writeback_control wbc = {
 		.sync_mode = WB_SYNC_ALL,
@@ -124,6 +163,32 @@ int simplefs_sync_inode(struct inode *inode) {
 	return sync_inode(inode, &wbc);
 }
 
+/*
+ * Gives the inode its own copy of a shared block. The old contents
+ * are only read when the page buffer does not already hold them, and
+ * then from the disk: shared blocks are never written in place, so the
+ * disk has them as they are.
+ */
+static long simplefs_cow_block(struct inode *inode, long bno, struct buffer_head *bh_result) {
+	struct buffer_head *old;
+	long new_bno;
+	char *kaddr;
+
+	if (!buffer_uptodate(bh_result)) {
+		if (!(old = simplefs_bread_disk(inode->i_sb, bno)))
+			return -EIO;
+		kaddr = kmap_atomic(bh_result->b_page, KM_USER0);
+		memcpy(kaddr + bh_offset(bh_result), old->b_data, SIMPLEFS_BLOCKSIZE);
+		kunmap_atomic(kaddr, KM_USER0);
+		set_buffer_uptodate(bh_result);
+		brelse(old);
+	}
+	if ((new_bno = simplefs_reserve_block(inode->i_sb, simplefs_alloc_goal(inode))) < 0)
+		return -ENOSPC;
+	bitmap_free_block(inode->i_sb, bno);
+	return new_bno;
+}
+
 int simplefs_get_block(struct inode *inode,
 			      sector_t block, struct buffer_head *bh_result, int create) {
 	struct buffer_head *bh;
@@ -139,14 +204,25 @@ int simplefs_get_block(struct inode *inode,
 		printk(KERN_ERR "simplefs_get_block failed: can't get raw inode\n");
 		return -EIO;
 	}
-	if (create && block == (inode->i_size >> SIMPLEFS_BLOCKBITS)) {
-		if ((bno = bitmap_alloc_block(inode->i_sb)) < 0)
+	if (create && block >= inode_blocks(inode)) {
+		if ((bno = simplefs_reserve_block(inode->i_sb, simplefs_alloc_goal(inode))) < 0) {
+			err = bno;
 			goto bitmap_failed;
+		}
 		raw_inode->i_data[block] = bno;
 		mark_buffer_dirty(bh);
+		mark_inode_dirty(inode);
 		printk(KERN_INFO "simplefs_get_block create block : %ld %lld %lld %ld\n", inode->i_ino, inode->i_size, block, bno);
+	} else if (create && bitmap_block_shared(inode->i_sb, raw_inode->i_data[block])) {
+		if ((bno = simplefs_cow_block(inode, raw_inode->i_data[block], bh_result)) < 0) {
+			err = bno;
+			goto bitmap_failed;
+		}
+		raw_inode->i_data[block] = bno;
+		mark_buffer_dirty(bh);
+		mark_inode_dirty(inode);
 	}
-	map_bh(bh_result, inode->i_sb, raw_inode->i_data[block]);
+	simplefs_map_bh(bh_result, inode->i_sb, raw_inode->i_data[block]);
 	brelse(bh);
 	return 0;
 
@@ -155,6 +231,29 @@ int simplefs_get_block(struct inode *inode,
 	return err;
 }
 
+/*
+ * Forget the mapping of page buffers that point at shared blocks, so
+ * the next write goes through simplefs_get_block and copies them.
+ */
+static void simplefs_unshare_buffers(struct page *page, unsigned from, unsigned to) {
+	struct super_block *sb = page->mapping->host->i_sb;
+	struct buffer_head *head, *bh;
+	unsigned start = 0;
+	long bno;
+
+	if (!page_has_buffers(page))
+		return;
+	bh = head = page_buffers(page);
+	do {
+		if (start < to && start + bh->b_size > from && buffer_mapped(bh) &&
+		    (bno = simplefs_logical_block(sb, bh->b_bdev, bh->b_blocknr)) >= 0 &&
+		    bitmap_block_shared(sb, bno))
+			clear_buffer_mapped(bh);
+		start += bh->b_size;
+		bh = bh->b_this_page;
+	} while (bh != head);
+}
+
 static int simplefs_readpage(struct file *file, struct page *page) {
 	printk(KERN_INFO "simplefs_readpage\n");
 	return block_read_full_page(page, simplefs_get_block);
@@ -162,20 +261,352 @@ static int simplefs_readpage(struct file *file, struct page *page) {
 
 static int simplefs_writepage(struct page *page, struct writeback_control *wbc) {
 	printk(KERN_INFO "simplefs_writepage\n");
+	simplefs_unshare_buffers(page, 0, PAGE_CACHE_SIZE);
 	return block_write_full_page(page, simplefs_get_block, wbc);
 }
 
 
 static int simplefs_write_begin(struct file *file, struct address_space *mapping, loff_t pos,
 				unsigned len, unsigned flags, struct page **pagep, void **fsdata) {
-	*pagep = NULL;
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+	int err;
+
 	printk(KERN_INFO "simplefs_write_begin: pos:%lld len:%d\n", pos, len);
-	return block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, simplefs_get_block);
+	if (!(page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT, flags)))
+		return -ENOMEM;
+	simplefs_unshare_buffers(page, from, from + len);
+	*pagep = page;
+	err = block_write_begin(file, mapping, pos, len, flags, pagep, fsdata, simplefs_get_block);
+	if (err) {
+		unlock_page(page);
+		page_cache_release(page);
+		*pagep = NULL;
+	}
+	return err;
+}
+
+/*
+ * A shared mapping is about to write to a page. A fault can't extend
+ * the file and simplefs files have no holes, so every block under
+ * i_size is already allocated: the only allocation left is copying
+ * blocks still shared with a clone. That copy is done here, so a full
+ * device fails the fault rather than writeback. Nothing is reserved
+ * for compressed files, whose clusters are sized and allocated by
+ * writepage; there ENOSPC leaves the page dirty for a later attempt.
+ */
+int simplefs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf) {
+	struct page *page = vmf->page;
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	unsigned end = PAGE_CACHE_SIZE;
+	loff_t size;
+	int err;
+
+	simplefs_heat_touch(inode, 1);
+	lock_page(page);
+	size = i_size_read(inode);
+	if (page->mapping != inode->i_mapping || page_offset(page) >= size) {
+		/* truncated under us */
+		unlock_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+	if (SIMPLEFS_I(inode)->i_flags & SIMPLEFS_INODE_COMPR)
+		return VM_FAULT_LOCKED;
+	if (((size - 1) >> PAGE_CACHE_SHIFT) == page->index)
+		end = ((size - 1) & ~PAGE_CACHE_MASK) + 1;
+	simplefs_unshare_buffers(page, 0, end);
+	err = block_prepare_write(page, 0, end, simplefs_get_block);
+	if (!err)
+		err = block_commit_write(page, 0, end);
+	if (err) {
+		unlock_page(page);
+		return err == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+	}
+	return VM_FAULT_LOCKED;
 }
 
+/*
+ * FIBMAP reports filesystem block numbers, which are only device
+ * blocks when the filesystem has a single device.
+ */
 static sector_t simplefs_bmap(struct address_space *mapping, sector_t block) {
+	struct inode *inode = mapping->host;
+	struct buffer_head tmp = {
+		.b_size = SIMPLEFS_BLOCKSIZE,
+	};
+	long bno;
+
 	printk(KERN_INFO "simplefs_bmap\n");
-	return generic_block_bmap(mapping, block, simplefs_get_block);
+	if (simplefs_get_block(inode, block, &tmp, 0))
+		return 0;
+	bno = simplefs_logical_block(inode->i_sb, tmp.b_bdev, tmp.b_blocknr);
+	return bno < 0 ? 0 : bno;
+}
+
+
+/*
+ * Makes dst share the blocks of src in [off, off + len). Both inodes are
+ * locked by the caller. Offsets are block aligned, and a partial last
+ * block is only allowed when it becomes the new end of dst.
+ */
+int simplefs_clone_range(struct inode *src, struct inode *dst,
+			 loff_t off, loff_t len, loff_t destoff) {
+	struct super_block *sb = src->i_sb;
+	struct buffer_head *src_bh, *dst_bh;
+	struct simplefs_inode *src_raw, *dst_raw;
+	unsigned long i, first, dfirst, nblocks;
+	int err;
+
+	/* straight from userspace, so nothing may overflow below */
+	if (off < 0 || len < 0 || destoff < 0 || off > src->i_size)
+		return -EINVAL;
+	if (!len)
+		len = src->i_size - off;
+	if (len > src->i_size - off || destoff > dst->i_size)
+		return -EINVAL;
+	/* compressed clusters can only be shared as a whole file */
+	if ((SIMPLEFS_I(src)->i_flags & SIMPLEFS_INODE_COMPR) &&
+	    (off || destoff || len != src->i_size || dst->i_size))
+		return -EINVAL;
+	if ((off | destoff) & (SIMPLEFS_BLOCKSIZE - 1))
+		return -EINVAL;
+	if ((len & (SIMPLEFS_BLOCKSIZE - 1)) &&
+	    (off + len != src->i_size || destoff + len < dst->i_size))
+		return -EINVAL;
+	first = off >> SIMPLEFS_BLOCKBITS;
+	dfirst = destoff >> SIMPLEFS_BLOCKBITS;
+	nblocks = (len + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+	if (SIMPLEFS_I(src)->i_flags & SIMPLEFS_INODE_COMPR)
+		nblocks = inode_slots(src);
+	if (dfirst > SIMPLEFS_BLOCKS_PER_INODE || nblocks > SIMPLEFS_BLOCKS_PER_INODE - dfirst)
+		return -EFBIG;
+
+	/* every source block must be on disk, and dst must have nothing pending */
+	if ((err = filemap_write_and_wait(src->i_mapping)))
+		return err;
+	if ((err = filemap_write_and_wait(dst->i_mapping)))
+		return err;
+
+	if (!(src_raw = simplefs_iget_raw(sb, src->i_ino, &src_bh)))
+		return -EIO;
+	if (!(dst_raw = simplefs_iget_raw(sb, dst->i_ino, &dst_bh))) {
+		brelse(src_bh);
+		return -EIO;
+	}
+	/* writepage of an mmap write may be rewriting the clusters */
+	mutex_lock(&SIMPLEFS_I(src)->i_compr_mutex);
+	for (i = 0; i < nblocks; i++) {
+		if (slot_mapped(src_raw->i_data[first + i]) &&
+		    (err = bitmap_get_block(sb, src_raw->i_data[first + i])))
+			break;
+		if (dfirst + i < inode_blocks(dst))
+			bitmap_free_block(sb, dst_raw->i_data[dfirst + i]);
+		dst_raw->i_data[dfirst + i] = src_raw->i_data[first + i];
+	}
+	mutex_unlock(&SIMPLEFS_I(src)->i_compr_mutex);
+	if (i) {
+		if (destoff + ((loff_t)i << SIMPLEFS_BLOCKBITS) > dst->i_size)
+			i_size_write(dst, min(destoff + len,
+					      destoff + ((loff_t)i << SIMPLEFS_BLOCKBITS)));
+		dst->i_blocks = dst->i_size >> SIMPLEFS_BLOCKBITS;
+		dst->i_mtime = dst->i_ctime = CURRENT_TIME_SEC;
+		mark_buffer_dirty(dst_bh);
+		mark_inode_dirty(dst);
+		invalidate_inode_pages2_range(dst->i_mapping, destoff >> PAGE_CACHE_SHIFT, -1);
+	}
+	brelse(dst_bh);
+	brelse(src_bh);
+	printk(KERN_INFO "simplefs_clone_range: %ld -> %ld %lu blocks: %d\n",
+	       src->i_ino, dst->i_ino, i, err);
+	return err;
+}
+
+/*
+ * Write a copy of each block to a new location and wait for all of
+ * them. Only for compressed files, whose clusters are written through
+ * the buffer cache, so that is where the current data is.
+ */
+static int simplefs_copy_blocks(struct super_block *sb, long *from, long to, int count) {
+	struct buffer_head *old, *new[SIMPLEFS_BLOCKS_PER_INODE];
+	int i, n, err = 0;
+
+	for (n = 0; n < count; n++) {
+		if (!(old = simplefs_bread(sb, from[n])) || !(new[n] = simplefs_getblk(sb, to + n))) {
+			brelse(old);
+			err = -EIO;
+			break;
+		}
+		lock_buffer(new[n]);
+		memcpy(new[n]->b_data, old->b_data, SIMPLEFS_BLOCKSIZE);
+		set_buffer_uptodate(new[n]);
+		clear_buffer_dirty(new[n]);
+		get_bh(new[n]);
+		new[n]->b_end_io = end_buffer_write_sync;
+		submit_bh(WRITE, new[n]);
+		brelse(old);
+	}
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(new[i]);
+		if (!buffer_uptodate(new[i]) && !err)
+			err = -EIO;
+		brelse(new[i]);
+	}
+	return err;
+}
+
+/*
+ * Point the buffers of the locked, uptodate pages of a file at the
+ * blocks in slots. With write set, also write every buffer of a mapped
+ * slot there from the page and wait for all of them, which copies the
+ * file as the page cache has it.
+ */
+static int simplefs_defrag_map(struct super_block *sb, struct page **pages, unsigned long npages,
+			       __le32 *slots, unsigned long nslots, int write) {
+	struct buffer_head *bh, *head, *bhs[SIMPLEFS_BLOCKS_PER_INODE];
+	unsigned long i, block;
+	int n = 0, err = 0;
+
+	for (i = 0; i < npages; i++) {
+		if (!page_has_buffers(pages[i]))
+			create_empty_buffers(pages[i], SIMPLEFS_BLOCKSIZE, 0);
+		bh = head = page_buffers(pages[i]);
+		block = i * SIMPLEFS_BLOCKS_PER_PAGE;
+		do {
+			if (block < nslots && slot_mapped(slots[block])) {
+				simplefs_map_bh(bh, sb, slots[block]);
+				if (write) {
+					lock_buffer(bh);
+					set_buffer_uptodate(bh);
+					clear_buffer_dirty(bh);
+					get_bh(bh);
+					bh->b_end_io = end_buffer_write_sync;
+					submit_bh(WRITE, bh);
+					bhs[n++] = bh;
+				}
+			}
+			block++;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]) && !err)
+			err = -EIO;
+		/* the page still holds the data */
+		set_buffer_uptodate(bhs[i]);
+		put_bh(bhs[i]);
+	}
+	return err;
+}
+
+/*
+ * Moves the blocks of a file into one contiguous run, in the hot or
+ * the cold region depending on its heat. The caller holds i_mutex,
+ * and every page of the file is read and locked while the blocks are
+ * copied and i_data is switched over, which keeps out readpage,
+ * writepage and mmap writes. The new blocks are written from those
+ * pages through their own buffers, which then stay pointed at them.
+ * The block device's cache is not used, since it may hold older
+ * copies of blocks whose data was written through the page cache.
+ * The old blocks are freed only once the new i_data is on disk.
+ */
+int simplefs_defrag(struct inode *inode) {
+	struct super_block *sb = inode->i_sb;
+	struct address_space *mapping = inode->i_mapping;
+	struct page *pages[SIMPLEFS_BLOCKS_PER_INODE], *page;
+	struct buffer_head *raw_bh;
+	struct simplefs_inode *raw_inode;
+	__le32 slots[SIMPLEFS_BLOCKS_PER_INODE];
+	long old[SIMPLEFS_BLOCKS_PER_INODE], start = -1;
+	unsigned long i, n, nslots, npages;
+	int compr = SIMPLEFS_I(inode)->i_flags & SIMPLEFS_INODE_COMPR;
+	int err;
+
+	if ((err = filemap_write_and_wait(mapping)))
+		return err;
+	if (!(raw_inode = simplefs_iget_raw(sb, inode->i_ino, &raw_bh)))
+		return -EIO;
+	for (npages = 0; npages < inode_pages(inode); npages++) {
+		if (compr) {
+			/* only the clusters are copied, the pages need not be read */
+			page = find_or_create_page(mapping, npages, GFP_NOFS);
+			err = -ENOMEM;
+		} else {
+			page = read_mapping_page(mapping, npages, NULL);
+			if (IS_ERR(page)) {
+				err = PTR_ERR(page);
+				page = NULL;
+			} else {
+				lock_page(page);
+				err = -EIO;
+				if (!PageUptodate(page)) {
+					unlock_page(page);
+					page_cache_release(page);
+					page = NULL;
+				}
+			}
+		}
+		if (!(pages[npages] = page))
+			goto out;
+		wait_on_page_writeback(page);
+	}
+	err = 0;
+
+	nslots = inode_slots(inode);
+	for (i = 0, n = 0; i < nslots; i++) {
+		if (slot_mapped(raw_inode->i_data[i]))
+			old[n++] = raw_inode->i_data[i];
+	}
+	for (i = 1; i < n && old[i] == old[i - 1] + 1; i++)
+		;
+	if (i >= n && (!n || simplefs_heat_placed(inode, old[0])))
+		goto out;	/* already contiguous, in the right region */
+	if ((start = bitmap_alloc_range(sb, n, simplefs_alloc_goal(inode))) < 0) {
+		err = start;
+		goto out;
+	}
+
+	for (i = 0, n = 0; i < nslots; i++) {
+		slots[i] = raw_inode->i_data[i];
+		if (slot_mapped(slots[i]))
+			slots[i] = start + n++;
+	}
+	if (compr)
+		err = simplefs_copy_blocks(sb, old, start, n);
+	else
+		err = simplefs_defrag_map(sb, pages, npages, slots, nslots, 1);
+	if (err)
+		goto failed;
+
+	memcpy(raw_inode->i_data, slots, nslots * sizeof(slots[0]));
+	mark_buffer_dirty(raw_bh);
+	if (sync_dirty_buffer(raw_bh) || !buffer_uptodate(raw_bh)) {
+		err = -EIO;
+		for (i = 0, n = 0; i < nslots; i++) {
+			if (slot_mapped(raw_inode->i_data[i]))
+				raw_inode->i_data[i] = old[n++];
+		}
+		mark_buffer_dirty(raw_bh);
+		goto failed;
+	}
+	for (i = 0; i < n; i++)
+		bitmap_free_block(sb, old[i]);
+	printk(KERN_INFO "simplefs_defrag: %ld %lu blocks -> %ld\n", inode->i_ino, n, start);
+	goto out;
+
+ failed:
+	/* back to the old blocks, which still hold the file */
+	if (!compr)
+		simplefs_defrag_map(sb, pages, npages, raw_inode->i_data, nslots, 0);
+	for (i = 0; i < n; i++)
+		bitmap_free_block(sb, start + i);
+ out:
+	while (npages-- > 0) {
+		unlock_page(pages[npages]);
+		page_cache_release(pages[npages]);
+	}
+	brelse(raw_bh);
+	return err;
 }
 
 
@@ -229,32 +660,47 @@ static inline int namecompare(int len, int maxlen, const char *name, const char
 	return !memcmp(name, buffer, len);
 }
 
+/*
+ * Look for a live dentry called name in bytes of directory data. The
+ * number of dentries looked at is added to *scanned.
+ */
+struct simplefs_dentry *simplefs_scan_dentries(char *kaddr, unsigned bytes,
+					       const char *name, int len,
+					       unsigned long *scanned) {
+	char *p, *limit = kaddr + bytes - SIMPLEFS_DENTRY_SIZE;
+
+	for (p = kaddr; p <= limit; p += SIMPLEFS_DENTRY_SIZE) {
+		struct simplefs_dentry *de = (struct simplefs_dentry *) p;
+		(*scanned)++;
+		if (de->flags == SIMPLEFS_DENTRY_UNUSED)
+			continue;
+		if (namecompare(len, SIMPLEFS_NAME_LEN, name, de->name))
+			return de;
+	}
+	return NULL;
+}
+
 struct simplefs_dentry *simplefs_find_dentry(struct inode *inode,
 					     struct dentry *dentry, struct page **rs_page) {
-	unsigned long n, npages = inode_pages(inode);
+	unsigned long n, scanned = 0, npages = inode_pages(inode);
+	struct simplefs_dentry *found;
 
 	printk(KERN_INFO "simplefs_find_dentry: %s\n", dentry->d_name.name);
+	found = simplefs_dirhash_find(inode, dentry, rs_page);
+	if (!IS_ERR(found))
+		return found;
 	for (n = 0; n < npages; n++) {
-		char *p, *kaddr, *limit;
 		struct page *page = simplefs_get_page(inode, n);
 		if (IS_ERR(page)) {
 			printk(KERN_INFO "page error\n");
 			continue;
 		}
-		p = kaddr = (char *)page_address(page);
-		limit = kaddr + inode_last_bytes(inode, n) - SIMPLEFS_DENTRY_SIZE;
-		for ( ; p <= limit; p += SIMPLEFS_DENTRY_SIZE) {
-			struct simplefs_dentry *de = (struct simplefs_dentry *) p;
-			if (de->flags == SIMPLEFS_DENTRY_UNUSED) {
-				printk(KERN_INFO "found an unused dentry: %s\n", de->name);
-				continue;
-			}
-			if (namecompare(dentry->d_name.len, SIMPLEFS_NAME_LEN,
-					dentry->d_name.name, de->name)) {
-				printk(KERN_INFO "match dentry: %s %s\n", dentry->d_name.name, de->name);
-				*rs_page = page;
-				return de;
-			}
+		found = simplefs_scan_dentries((char *)page_address(page), inode_last_bytes(inode, n),
+					       dentry->d_name.name, dentry->d_name.len, &scanned);
+		if (found) {
+			printk(KERN_INFO "match dentry: %s after %lu\n", dentry->d_name.name, scanned);
+			*rs_page = page;
+			return found;
 		}
 		simplefs_put_page(page);
 	}
@@ -289,6 +735,7 @@ int simplefs_insert_dentry(struct dentry *dentry, struct inode *inode) {
 	block_write_end(NULL, page->mapping, pos, sizeof(de), sizeof(de), page, NULL);
 
 	i_size_write(dir, pos + sizeof(de));
+	simplefs_dirhash_add(dir, name, namelen, pos);
 	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
 	mark_inode_dirty(dir);
 	
@@ -319,6 +766,7 @@ int simplefs_delete_dentry(struct simplefs_dentry *de, struct page *page) {
 
 	de->flags = SIMPLEFS_DENTRY_UNUSED;
 	block_write_end(NULL, mapping, pos, sizeof(*de), sizeof(*de), page, NULL);
+	simplefs_dirhash_remove(inode, de->name, strnlen(de->name, SIMPLEFS_NAME_LEN));
 	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
 	mark_inode_dirty(inode);
 
@@ -0,0 +1,150 @@
+/*
+ * linux/fs/sfs/ioctl.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/file.h>
+#include <linux/mount.h>
+#include <asm/uaccess.h>
+#include "simplefs.h"
+
+/*
+ * Lock two different inodes in a stable order.
+ */
+static void simplefs_lock_two(struct inode *a, struct inode *b) {
+	if (a > b) {
+		struct inode *t = a;
+		a = b;
+		b = t;
+	}
+	mutex_lock_nested(&a->i_mutex, I_MUTEX_PARENT);
+	mutex_lock_nested(&b->i_mutex, I_MUTEX_CHILD);
+}
+
+static long simplefs_ioctl_clone(struct file *dst_file, unsigned long srcfd,
+				 u64 off, u64 len, u64 destoff) {
+	struct inode *dst = dst_file->f_path.dentry->d_inode;
+	struct inode *src;
+	struct file *src_file;
+	long err;
+
+	if (!(dst_file->f_mode & FMODE_WRITE) || (dst_file->f_flags & O_APPEND))
+		return -EBADF;
+	if (!(src_file = fget(srcfd)))
+		return -EBADF;
+	src = src_file->f_path.dentry->d_inode;
+
+	err = -EBADF;
+	if (!(src_file->f_mode & FMODE_READ))
+		goto out;
+	err = -EXDEV;
+	if (src->i_sb != dst->i_sb)
+		goto out;
+	err = -EINVAL;
+	if (src == dst || !S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		goto out;
+	if ((SIMPLEFS_I(src)->i_flags ^ SIMPLEFS_I(dst)->i_flags) & SIMPLEFS_INODE_COMPR)
+		goto out;
+	if ((err = mnt_want_write(dst_file->f_path.mnt)))
+		goto out;
+
+	simplefs_lock_two(src, dst);
+	err = simplefs_clone_range(src, dst, off, len, destoff);
+	mutex_unlock(&src->i_mutex);
+	mutex_unlock(&dst->i_mutex);
+	mnt_drop_write(dst_file->f_path.mnt);
+ out:
+	fput(src_file);
+	return err;
+}
+
+static long simplefs_ioctl_defrag(struct file *filp) {
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	long err;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if ((err = mnt_want_write(filp->f_path.mnt)))
+		return err;
+	mutex_lock(&inode->i_mutex);
+	err = simplefs_defrag(inode);
+	mutex_unlock(&inode->i_mutex);
+	mnt_drop_write(filp->f_path.mnt);
+	return err;
+}
+
+/*
+ * Only FS_COMPR_FL is supported. Directories pass it on to the files
+ * created in them; a regular file can only switch while it is empty,
+ * since the two formats lay out i_data differently.
+ */
+static long simplefs_ioctl_setflags(struct file *filp, unsigned long arg) {
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+	unsigned int flags;
+	__u32 new_flags;
+	long err;
+
+	if (!is_owner_or_cap(inode))
+		return -EACCES;
+	if (get_user(flags, (int __user *)arg))
+		return -EFAULT;
+	if (flags & ~FS_COMPR_FL)
+		return -EOPNOTSUPP;
+	if ((err = mnt_want_write(filp->f_path.mnt)))
+		return err;
+
+	mutex_lock(&inode->i_mutex);
+	new_flags = si->i_flags & ~SIMPLEFS_INODE_COMPR;
+	if (flags & FS_COMPR_FL)
+		new_flags |= SIMPLEFS_INODE_COMPR;
+	if (new_flags != si->i_flags) {
+		if (S_ISREG(inode->i_mode) && (inode->i_size || inode->i_mapping->nrpages)) {
+			err = -EINVAL;
+			goto out;
+		}
+		si->i_flags = new_flags;
+		simplefs_set_inode_ops(inode);
+		inode->i_ctime = CURRENT_TIME_SEC;
+		mark_inode_dirty(inode);
+	}
+ out:
+	mutex_unlock(&inode->i_mutex);
+	mnt_drop_write(filp->f_path.mnt);
+	return err;
+}
+
+long simplefs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+	struct inode *inode = filp->f_path.dentry->d_inode;
+	struct simplefs_clone_range range;
+	struct simplefs_heat heat;
+	unsigned int flags;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		flags = 0;
+		if (SIMPLEFS_I(inode)->i_flags & SIMPLEFS_INODE_COMPR)
+			flags |= FS_COMPR_FL;
+		return put_user(flags, (int __user *)arg);
+	case FS_IOC_SETFLAGS:
+		return simplefs_ioctl_setflags(filp, arg);
+	case SIMPLEFS_IOC_CLONE:
+		return simplefs_ioctl_clone(filp, arg, 0, 0, 0);
+	case SIMPLEFS_IOC_CLONE_RANGE:
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		return simplefs_ioctl_clone(filp, range.src_fd, range.src_offset,
+					    range.src_length, range.dest_offset);
+	case SIMPLEFS_IOC_DEFRAG:
+		return simplefs_ioctl_defrag(filp);
+	case SIMPLEFS_IOC_GETHEAT:
+		simplefs_heat_get(inode, &heat);
+		return copy_to_user((void __user *)arg, &heat, sizeof(heat)) ? -EFAULT : 0;
+	default:
+		return -ENOTTY;
+	}
+}
@@ -3,12 +3,17 @@ package main
 import (
 	"os"
 	"fmt"
+	"flag"
 	"bytes"
 	"time"
+	"math/rand"
 	"encoding/binary"
 )
 
-func init_super_block(f *os.File) (err error) {
+// marks the orphan list in the superblock block as written by us
+const orphan_magic = 0x4e50524f
+
+func init_super_block(f *os.File, nr_devices int, stripe int, fsid uint32) (err error) {
 	buf := new(bytes.Buffer)
 	binary.Write(buf, binary.LittleEndian, uint32(2))
 	binary.Write(buf, binary.LittleEndian, uint32(8192))
@@ -16,10 +21,39 @@ func init_super_block(f *os.File) (err error) {
 	binary.Write(buf, binary.LittleEndian, uint32(2))
 	binary.Write(buf, binary.LittleEndian, uint32(8192))
 	binary.Write(buf, binary.LittleEndian, uint32(8192))
+	binary.Write(buf, binary.LittleEndian, uint32(refcount_blocks))
+	binary.Write(buf, binary.LittleEndian, uint32(nr_devices))
+	binary.Write(buf, binary.LittleEndian, uint32(stripe))
+	binary.Write(buf, binary.LittleEndian, fsid)
+	binary.Write(buf, binary.LittleEndian, uint32(orphan_magic))
+	// the rest of the block is the orphan list, empty
+	buf.Write(make([]byte, 512 - buf.Len()))
 	f.Write(buf.Bytes())
 	return
 }
 
+// header block of the extra devices of a striped filesystem
+const member_magic = 0x54535346
+
+func init_member(f *os.File, fsid uint32, index int) (err error) {
+	buf := new(bytes.Buffer)
+	binary.Write(buf, binary.LittleEndian, uint32(member_magic))
+	binary.Write(buf, binary.LittleEndian, fsid)
+	binary.Write(buf, binary.LittleEndian, uint32(index))
+	buf.Write(make([]byte, 512 - buf.Len()))
+	_, err = f.WriteAt(buf.Bytes(), 0)
+	return
+}
+
+// one refcount byte per data block, right after the inode table
+const refcount_blocks = 8192 / 512
+
+func init_refcount_table(f *os.File) (err error) {
+	f.Seek(512 * (5 + 8192), 0)
+	f.Write(make([]byte, 512 * refcount_blocks))
+	return
+}
+
 func init_inode_table(f *os.File) (err error) {
 	f.Seek(512, 0)
 	buf := new(bytes.Buffer)
@@ -47,18 +81,41 @@ func init_inode_table(f *os.File) (err error) {
 
 
 func main() {
-	if len(os.Args) != 2 {
-		fmt.Println("Usage: mkfs dev_name")
+	stripe := flag.Int("stripe", 8, "stripe unit in blocks when striping over several devices")
+	flag.Parse()
+	devs := flag.Args()
+	if len(devs) < 1 || len(devs) > 8 || *stripe < 1 {
+		fmt.Println("Usage: mkfs [-stripe blocks] dev_name [dev_name...]")
 		return
 	}
-	dev_name := os.Args[1]
-	f, err := os.OpenFile(dev_name, os.O_WRONLY, 0644)
+	rand.Seed(time.Now().UnixNano())
+	fsid := rand.Uint32()
+	nr_devices := len(devs)
+	if nr_devices == 1 {
+		nr_devices, *stripe = 0, 0
+	}
+
+	for i := 1; i < len(devs); i++ {
+		m, err := os.OpenFile(devs[i], os.O_WRONLY, 0644)
+		if err != nil {
+			fmt.Println(err)
+			return
+		}
+		err = init_member(m, fsid, i)
+		m.Close()
+		if err != nil {
+			fmt.Println(err)
+			return
+		}
+	}
+	f, err := os.OpenFile(devs[0], os.O_WRONLY, 0644)
 	if err != nil {
 		fmt.Println(err)
 		return
 	}
 	defer f.Close()
-	init_super_block(f)
+	init_super_block(f, nr_devices, *stripe, fsid)
 	init_inode_table(f)
+	init_refcount_table(f)
 	return
 }
@@ -0,0 +1,239 @@
+/*
+ * linux/fs/sfs/orphan.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include "simplefs.h"
+
+/*
+ * Unlinked inodes are not freed by the task that drops the last
+ * reference. Their numbers sit in the orphan list at the end of the
+ * superblock block, and a worker frees their blocks and inode bits in
+ * batches. An inode goes on the list as soon as its last link is
+ * removed, so one still open when the machine went down is freed at
+ * the next mount too.
+ */
+
+#define SIMPLEFS_ORPHAN_DELAY (HZ / 10)
+#define SIMPLEFS_ORPHAN_BATCH 16
+
+static struct workqueue_struct *simplefs_orphan_wq;
+
+static __le32 *orphan_slots(struct simplefs_super_info *sbi) {
+	return (__le32 *)(sbi->s_sb->b_data + SIMPLEFS_ORPHAN_OFFSET);
+}
+
+/*
+ * Put an inode on the orphan list unless it is there already. Fails
+ * when the list is full.
+ */
+int simplefs_orphan_add(struct inode *inode) {
+	struct simplefs_super_info *sbi = inode->i_sb->s_fs_info;
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+	int slot;
+
+	if (si->i_orphan >= 0)
+		return 0;
+	/* no list on this image, see simplefs_orphan_replay */
+	if (sbi->raw_super.s_orphan_magic != SIMPLEFS_ORPHAN_MAGIC)
+		return -ENOSPC;
+	spin_lock(&sbi->s_orphan_lock);
+	slot = find_first_zero_bit(sbi->s_orphan_used, SIMPLEFS_ORPHANS);
+	if (slot < SIMPLEFS_ORPHANS) {
+		__set_bit(slot, sbi->s_orphan_used);
+		orphan_slots(sbi)[slot] = cpu_to_le32(inode->i_ino);
+		si->i_orphan = slot;
+	}
+	spin_unlock(&sbi->s_orphan_lock);
+	if (slot >= SIMPLEFS_ORPHANS)
+		return -ENOSPC;
+	mark_buffer_dirty(sbi->s_sb);
+	return 0;
+}
+
+/* free the blocks an inode maps and leave it empty */
+static void simplefs_orphan_truncate(struct super_block *sb, struct simplefs_inode *raw_inode) {
+	unsigned long i, slots;
+
+	slots = simplefs_slots(raw_inode->i_size, raw_inode->i_mode >> SIMPLEFS_FLAGS_SHIFT);
+	for (i = 0; i < slots; i++) {
+		if (slot_mapped(raw_inode->i_data[i]))
+			bitmap_free_block(sb, raw_inode->i_data[i]);
+	}
+	memset(raw_inode->i_data, 0, sizeof(raw_inode->i_data));
+	raw_inode->i_size = 0;
+}
+
+/*
+ * Called from delete_inode once nothing uses the inode. The size and
+ * flags the blocks are mapped with go to the inode table, since the
+ * inode may still be dirty, and the worker does the rest. Only when
+ * the orphan list is full is the inode freed right here.
+ */
+void simplefs_orphan_delete(struct inode *inode) {
+	struct super_block *sb = inode->i_sb;
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+	struct simplefs_inode *raw_inode;
+	struct buffer_head *bh;
+
+	if (!(raw_inode = simplefs_iget_raw(sb, inode->i_ino, &bh))) {
+		/* still on the list if it got there, for the next mount */
+		printk(KERN_ERR "simplefs_orphan_delete failed: %ld\n", inode->i_ino);
+		goto out;
+	}
+	raw_inode->i_size = inode->i_size;
+	raw_inode->i_mode = inode->i_mode | (si->i_flags << SIMPLEFS_FLAGS_SHIFT);
+	raw_inode->i_nlink = 0;
+	if (simplefs_orphan_add(inode)) {
+		simplefs_orphan_truncate(sb, raw_inode);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+		bitmap_free_inode(sb, inode->i_ino);
+		goto out;
+	}
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	spin_lock(&sbi->s_orphan_lock);
+	__set_bit(si->i_orphan, sbi->s_orphan_ready);
+	spin_unlock(&sbi->s_orphan_lock);
+	queue_delayed_work(simplefs_orphan_wq, &sbi->s_orphan_work, SIMPLEFS_ORPHAN_DELAY);
+ out:
+	clear_inode(inode);
+}
+
+/*
+ * Free up to SIMPLEFS_ORPHAN_BATCH ready orphans. The slots are
+ * cleared before the inode bits, so a crash in between leaks an inode
+ * rather than replaying a number that was handed out again. An inode
+ * whose on-disk link count is not zero is still reachable, its slot
+ * outlived a crash before the inode was written, so it is only taken
+ * off the list. Returns the number of orphans taken off the list.
+ */
+static int simplefs_orphan_reap(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_inode *raw_inode;
+	struct buffer_head *bh;
+	int slot, i, n = 0;
+	int slots[SIMPLEFS_ORPHAN_BATCH];
+	long inos[SIMPLEFS_ORPHAN_BATCH];
+
+	spin_lock(&sbi->s_orphan_lock);
+	for (slot = 0; n < SIMPLEFS_ORPHAN_BATCH; slot++) {
+		slot = find_next_bit(sbi->s_orphan_ready, SIMPLEFS_ORPHANS, slot);
+		if (slot >= SIMPLEFS_ORPHANS)
+			break;
+		__clear_bit(slot, sbi->s_orphan_ready);
+		slots[n] = slot;
+		inos[n++] = le32_to_cpu(orphan_slots(sbi)[slot]);
+	}
+	spin_unlock(&sbi->s_orphan_lock);
+	if (!n)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (!(raw_inode = simplefs_iget_raw(sb, inos[i], &bh))) {
+			printk(KERN_ERR "simplefs_orphan_reap: can't read inode %ld\n", inos[i]);
+			inos[i] = -1;
+			continue;
+		}
+		if (le32_to_cpu(raw_inode->i_nlink)) {
+			printk(KERN_ERR "simplefs_orphan_reap: inode %ld is still linked\n", inos[i]);
+			brelse(bh);
+			inos[i] = -1;
+			continue;
+		}
+		simplefs_orphan_truncate(sb, raw_inode);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+	}
+	spin_lock(&sbi->s_orphan_lock);
+	for (i = 0; i < n; i++) {
+		orphan_slots(sbi)[slots[i]] = 0;
+		__clear_bit(slots[i], sbi->s_orphan_used);
+	}
+	spin_unlock(&sbi->s_orphan_lock);
+	mark_buffer_dirty(sbi->s_sb);
+	for (i = 0; i < n; i++) {
+		if (inos[i] >= 0)
+			bitmap_free_inode(sb, inos[i]);
+	}
+	return n;
+}
+
+void simplefs_orphan_work(struct work_struct *work) {
+	struct simplefs_super_info *sbi =
+		container_of(work, struct simplefs_super_info, s_orphan_work.work);
+
+	while (simplefs_orphan_reap(sbi->s_super))
+		cond_resched();
+}
+
+static unsigned long simplefs_inode_count(struct simplefs_super_info *sbi) {
+	return min_t(unsigned long, sbi->raw_super.s_inode_blknr * SIMPLEFS_INODES_PER_BLOCK,
+		     sbi->raw_super.s_inode_bitmap_blknr * SIMPLEFS_BLOCKSIZE * 8);
+}
+
+/*
+ * At mount, whatever is on the list was left by a crash, and nothing
+ * can be using it. On an image from an older mkfs the list is whatever
+ * was on the device, so it is cleared and marked in use instead, or
+ * left off altogether on a read-only mount.
+ */
+void simplefs_orphan_replay(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	__le32 *slots = orphan_slots(sbi);
+	int slot, n = 0;
+
+	if (sbi->raw_super.s_orphan_magic != SIMPLEFS_ORPHAN_MAGIC) {
+		if (sb->s_flags & MS_RDONLY)
+			return;
+		memset(slots, 0, SIMPLEFS_ORPHANS * sizeof(__le32));
+		sbi->raw_super.s_orphan_magic = SIMPLEFS_ORPHAN_MAGIC;
+		((struct simplefs_super *)sbi->s_sb->b_data)->s_orphan_magic = SIMPLEFS_ORPHAN_MAGIC;
+		mark_buffer_dirty(sbi->s_sb);
+		printk(KERN_INFO "Simplefs: orphan list set up\n");
+		return;
+	}
+	for (slot = 0; slot < SIMPLEFS_ORPHANS; slot++) {
+		u32 ino = le32_to_cpu(slots[slot]);
+		if (!ino)
+			continue;
+		/* a free slot as far as we are concerned */
+		if (ino == SIMPLEFS_ROOT_INO || ino >= simplefs_inode_count(sbi)) {
+			printk(KERN_ERR "Simplefs: bad orphan inode %u ignored\n", ino);
+			continue;
+		}
+		__set_bit(slot, sbi->s_orphan_used);
+		__set_bit(slot, sbi->s_orphan_ready);
+		n++;
+	}
+	/* a read-only mount leaves them for the next one */
+	if (n && !(sb->s_flags & MS_RDONLY)) {
+		printk(KERN_INFO "Simplefs: freeing %d orphan inodes\n", n);
+		queue_delayed_work(simplefs_orphan_wq, &sbi->s_orphan_work, 0);
+	}
+}
+
+/* at unmount, free everything still waiting */
+void simplefs_orphan_stop(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+
+	cancel_delayed_work_sync(&sbi->s_orphan_work);
+	if (!(sb->s_flags & MS_RDONLY))
+		simplefs_orphan_work(&sbi->s_orphan_work.work);
+}
+
+int simplefs_orphan_init(void) {
+	if (!(simplefs_orphan_wq = create_singlethread_workqueue("simplefs_orphan")))
+		return -ENOMEM;
+	return 0;
+}
+
+void simplefs_orphan_exit(void) {
+	destroy_workqueue(simplefs_orphan_wq);
+}
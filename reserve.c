@@ -0,0 +1,146 @@
+/*
+ * linux/fs/sfs/reserve.c
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+#include <linux/percpu.h>
+#include <linux/smp.h>
+#include "simplefs.h"
+
+/*
+ * Every cpu keeps a few inode numbers and data blocks claimed from the
+ * bitmaps in batches, so parallel creates and writes don't all scan
+ * the same bitmap block. Blocks are kept apart by the goal they were
+ * claimed for, the hot region or the rest (see heat.c). A batch is
+ * set in the on-disk bitmaps when it is claimed, so handing a number
+ * out touches nothing shared, and a number can't be handed out twice
+ * after a crash. What a crash catches in the caches stays marked used
+ * on disk: at most SIMPLEFS_RESERVE_BATCH numbers per pool and cpu.
+ * What is left goes back when an allocation runs out of space and at
+ * unmount.
+ */
+
+#define SIMPLEFS_RESERVE_BATCH 32
+
+enum { RESERVE_INODES, RESERVE_HOT, RESERVE_COLD, RESERVE_POOLS };
+
+struct simplefs_pool {
+	int next, nr;
+	long ids[SIMPLEFS_RESERVE_BATCH];
+};
+
+struct simplefs_reserve {
+	spinlock_t lock;
+	struct simplefs_pool pools[RESERVE_POOLS];
+};
+
+static int simplefs_reserve_fill(struct super_block *sb, int pool, long goal, long *ids) {
+	if (pool == RESERVE_INODES)
+		return bitmap_reserve_inodes(sb, ids, SIMPLEFS_RESERVE_BATCH);
+	return bitmap_reserve_blocks(sb, goal, ids, SIMPLEFS_RESERVE_BATCH);
+}
+
+/* ids is overwritten */
+static void simplefs_reserve_put(struct super_block *sb, int pool, long *ids, int n) {
+	if (pool == RESERVE_INODES)
+		bitmap_unreserve_inodes(sb, ids, n);
+	else
+		bitmap_unreserve_blocks(sb, ids, n);
+}
+
+/*
+ * Take the next number of a pool of this cpu, refilling it from the
+ * bitmaps when it is empty. May sleep; the cpu may change under us,
+ * which only means another cpu's pool gets used.
+ */
+static long simplefs_reserve_get(struct super_block *sb, int pool, long goal) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_reserve *res;
+	struct simplefs_pool *p;
+	long ids[SIMPLEFS_RESERVE_BATCH], id;
+	int n, drained = 0;
+
+ again:
+	res = per_cpu_ptr(sbi->s_reserve, raw_smp_processor_id());
+	p = &res->pools[pool];
+	spin_lock(&res->lock);
+	if (p->next < p->nr) {
+		id = p->ids[p->next++];
+		spin_unlock(&res->lock);
+		return id;
+	}
+	spin_unlock(&res->lock);
+
+	if (!(n = simplefs_reserve_fill(sb, pool, goal, ids))) {
+		/* what the other cpus hold may be all there is */
+		if (drained++)
+			return -ENOSPC;
+		simplefs_reserve_drain(sb);
+		goto again;
+	}
+	spin_lock(&res->lock);
+	if (p->next < p->nr) {
+		/* refilled while we were at the bitmaps */
+		id = p->ids[p->next++];
+		spin_unlock(&res->lock);
+		simplefs_reserve_put(sb, pool, ids, n);
+		return id;
+	}
+	memcpy(p->ids, ids, n * sizeof(long));
+	p->nr = n;
+	p->next = 1;
+	spin_unlock(&res->lock);
+	return ids[0];
+}
+
+long simplefs_reserve_inode(struct super_block *sb) {
+	return simplefs_reserve_get(sb, RESERVE_INODES, 0);
+}
+
+/* goal is one of what simplefs_alloc_goal returns */
+long simplefs_reserve_block(struct super_block *sb, long goal) {
+	return simplefs_reserve_get(sb, goal ? RESERVE_COLD : RESERVE_HOT, goal);
+}
+
+/* give everything the caches hold back to the bitmaps */
+void simplefs_reserve_drain(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	struct simplefs_reserve *res;
+	struct simplefs_pool *p;
+	long ids[SIMPLEFS_RESERVE_BATCH];
+	int cpu, pool, n;
+
+	for_each_possible_cpu(cpu) {
+		res = per_cpu_ptr(sbi->s_reserve, cpu);
+		for (pool = 0; pool < RESERVE_POOLS; pool++) {
+			p = &res->pools[pool];
+			spin_lock(&res->lock);
+			n = p->nr - p->next;
+			memcpy(ids, p->ids + p->next, n * sizeof(long));
+			p->next = p->nr = 0;
+			spin_unlock(&res->lock);
+			simplefs_reserve_put(sb, pool, ids, n);
+		}
+	}
+}
+
+int simplefs_reserve_start(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	int cpu;
+
+	if (!(sbi->s_reserve = alloc_percpu(struct simplefs_reserve)))
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbi->s_reserve, cpu)->lock);
+	return 0;
+}
+
+void simplefs_reserve_stop(struct super_block *sb) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+
+	simplefs_reserve_drain(sb);
+	free_percpu(sbi->s_reserve);
+	sbi->s_reserve = NULL;
+}
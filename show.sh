@@ -8,7 +8,7 @@ showinode() {
 }
 
 showde() {
-	sb=$((4196864 + $1 * 28))
+	sb=$((4205056 + $1 * 28))
 	hexdump -d -s $sb -n 28 /dev/mmcblk0p1
 }
 
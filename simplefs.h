@@ -12,6 +12,7 @@
 
 #include <linux/pagemap.h>
 #include <linux/fs.h>
+#include <linux/workqueue.h>
 
 #define SIMPLEFS_ROOT_INO 0
 
@@ -29,32 +30,138 @@ struct simplefs_super {
 	__le32 s_block_bitmap_blknr;
 	__le32 s_block_blknr;
 	__le32 s_free_blocks_count;
+
+	/*
+	 * One byte per data block, counting the extra owners of the block
+	 * created by clone. 0 on images made without a refcount table,
+	 * which disables cloning.
+	 */
+	__le32 s_refcount_blknr;
+
+	/*
+	 * Data blocks are striped over s_nr_devices devices in units of
+	 * s_stripe_blknr blocks. This device holds the superblock and all
+	 * other metadata, the rest start with a simplefs_member header
+	 * carrying the same s_fsid. 0 devices means a single device.
+	 */
+	__le32 s_nr_devices;
+	__le32 s_stripe_blknr;
+	__le32 s_fsid;
+
+	/*
+	 * SIMPLEFS_ORPHAN_MAGIC once the orphan list below is in use.
+	 * Older mkfs left the rest of the block unwritten.
+	 */
+	__le32 s_orphan_magic;
+};
+
+/*
+ * The rest of the superblock block is the orphan list: the numbers of
+ * unlinked inodes whose blocks have not been freed yet, 0 in a free
+ * slot. See orphan.c.
+ */
+#define SIMPLEFS_ORPHAN_OFFSET 64
+#define SIMPLEFS_ORPHANS ((SIMPLEFS_BLOCKSIZE - SIMPLEFS_ORPHAN_OFFSET) / sizeof(__le32))
+#define SIMPLEFS_ORPHAN_MAGIC 0x4e50524f	/* "ORPN" */
+
+#define SIMPLEFS_MEMBER_MAGIC 0x54535346	/* "FSST" */
+#define SIMPLEFS_MEMBER_BNO 0
+#define SIMPLEFS_MAX_DEVICES 8
+
+struct simplefs_member {
+	__le32 m_magic;
+	__le32 m_fsid;
+	__le32 m_index;
 };
 
+/* mount options */
+#define SIMPLEFS_MOUNT_LAZYTIME 0x0001
+
+/* longest a timestamp-only change stays in memory with lazytime */
+#define SIMPLEFS_LAZYTIME_EXPIRE (12 * 60 * 60 * HZ)
+
+struct simplefs_reserve;
+
 struct simplefs_super_info {
+	unsigned long s_mount_opt;
 	struct buffer_head *s_sb;
-	struct buffer_head **s_bitmaps;
+	struct buffer_head **s_bitmaps;		/* read on first use */
+	unsigned long **s_claimed;		/* where allocators claim bits */
+	struct buffer_head **s_refcounts;	/* read on first use */
+	struct mutex s_bitmap_mutex;
+	spinlock_t s_ref_lock;
+	struct mutex s_flush_mutex;
+	atomic_long_t s_flush_seq;
+	unsigned long s_flush_done;
+	struct mutex s_compr_mutex;		/* sets up s_compr_wrkmem */
+	void **s_compr_wrkmem;			/* per cpu LZO work memory */
+	char *s_devices;			/* devices= mount option */
+	fmode_t s_dev_mode;
+	int s_nr_devices;
+	struct block_device *s_devs[SIMPLEFS_MAX_DEVICES];
+	spinlock_t s_orphan_lock;
+	DECLARE_BITMAP(s_orphan_used, SIMPLEFS_ORPHANS);
+	DECLARE_BITMAP(s_orphan_ready, SIMPLEFS_ORPHANS);	/* nothing uses the inode */
+	struct delayed_work s_orphan_work;
+	struct super_block *s_super;
+	struct simplefs_reserve *s_reserve;	/* per cpu, see reserve.c */
 	struct simplefs_super raw_super;
 };
 
+#define SIMPLEFS_REF_MAX 255
+
 
 #define SIMPLEFS_BLOCKS_PER_INODE 15
 struct simplefs_inode {
 	__le32 i_size;
 	__le32 i_time;
-	__le32 i_mode;
+	__le32 i_mode;		/* inode flags live in the upper 16 bits */
 	__le32 i_nlink;
 	__le32 i_data[SIMPLEFS_BLOCKS_PER_INODE];
 };
 
+#define SIMPLEFS_FLAGS_SHIFT 16
+
+/* inode flags */
+#define SIMPLEFS_INODE_COMPR 0x0001	/* data stored as compressed clusters */
+
+struct simplefs_dirhash;
+
+struct simplefs_inode_info {
+	__u32 i_flags;
+	struct simplefs_dirhash *i_dirhash;	/* name index, directories only */
+
+	/* what the inode table holds, to spot timestamp-only changes */
+	__u32 i_disk_mode;
+	__u32 i_disk_nlink;
+	__u32 i_disk_size;
+	unsigned long i_lazy_since;	/* jiffies, 0 when nothing deferred */
+	int i_orphan;			/* orphan list slot, -1 when not on it */
+	unsigned i_heat_reads;		/* decayed access counts, see heat.c */
+	unsigned i_heat_writes;
+	unsigned long i_heat_stamp;	/* jiffies of the last decay */
+	struct mutex i_compr_mutex;	/* cluster slots of a compressed file */
+
+	struct inode vfs_inode;
+};
+
+static inline struct simplefs_inode_info *SIMPLEFS_I(struct inode *inode) {
+	return container_of(inode, struct simplefs_inode_info, vfs_inode);
+}
+
 struct simplefs_inode *simplefs_iget_raw(struct super_block *sb,
 					 long ino, struct buffer_head **bh);
 struct inode *simplefs_iget(struct super_block *sb, long ino);
+struct inode *simplefs_inew(struct super_block *sb, long ino);
+void simplefs_set_inode_ops(struct inode *inode);
 void simplefs_truncate(struct inode *inode);
-int simplefs_free_inode(struct inode *inode);
 int simplefs_get_block(struct inode *inode,
 		       sector_t block, struct buffer_head *bh_result, int create);
 int simplefs_sync_inode(struct inode *inode);
+int simplefs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf);
+int simplefs_clone_range(struct inode *src, struct inode *dst,
+			 loff_t off, loff_t len, loff_t destoff);
+int simplefs_defrag(struct inode *inode);
 
 
 static inline int inode_last_bytes(struct inode *inode, unsigned long page_nr) {
@@ -70,13 +177,57 @@ static inline unsigned long inode_pages(struct inode *inode) {
 	return (inode->i_size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT;
 }
 
+/*
+ * Files have no holes, so every block below this one is mapped.
+ */
+static inline unsigned long inode_blocks(struct inode *inode) {
+	return (inode->i_size + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+}
+
+#define SIMPLEFS_BLOCKS_PER_PAGE (PAGE_CACHE_SIZE >> SIMPLEFS_BLOCKBITS)
+
+/* i_data slot that follows the blocks of a compressed cluster */
+#define SIMPLEFS_COMPR_MARK 0xffffffff
+
+static inline int slot_mapped(__u32 slot) {
+	return slot && slot != SIMPLEFS_COMPR_MARK;
+}
+
+/*
+ * Number of i_data slots that may be in use. A compressed file owns
+ * whole page sized clusters of slots, some of them left empty.
+ */
+static inline unsigned long simplefs_slots(loff_t size, __u32 flags) {
+	unsigned long slots = (size + SIMPLEFS_BLOCKSIZE - 1) >> SIMPLEFS_BLOCKBITS;
+
+	if (flags & SIMPLEFS_INODE_COMPR)
+		slots = ((size + PAGE_CACHE_SIZE - 1) >> PAGE_CACHE_SHIFT) * SIMPLEFS_BLOCKS_PER_PAGE;
+	return min_t(unsigned long, slots, SIMPLEFS_BLOCKS_PER_INODE);
+}
+
+static inline unsigned long inode_slots(struct inode *inode) {
+	return simplefs_slots(inode->i_size, SIMPLEFS_I(inode)->i_flags);
+}
+
 void simplefs_put_page(struct page *page);
 struct page *simplefs_get_page(struct inode *dir, unsigned long n);
+struct simplefs_dentry *simplefs_scan_dentries(char *kaddr, unsigned bytes,
+					       const char *name, int len,
+					       unsigned long *scanned);
 struct simplefs_dentry *simplefs_find_dentry(struct inode *inode,
 					     struct dentry *dentry, struct page **rs_page);
 int simplefs_insert_dentry(struct dentry *dentry, struct inode *inode);
 int simplefs_delete_dentry(struct simplefs_dentry *de, struct page *page);
 
+/* dirhash.c */
+struct simplefs_dentry *simplefs_dirhash_find(struct inode *dir, struct dentry *dentry,
+					      struct page **rs_page);
+void simplefs_dirhash_add(struct inode *dir, const char *name, int len, loff_t pos);
+void simplefs_dirhash_remove(struct inode *dir, const char *name, int len);
+void simplefs_dirhash_drop(struct inode *dir);
+void simplefs_dirhash_init(void);
+void simplefs_dirhash_exit(void);
+
 
 #define SIMPLEFS_NAME_LEN 20
 
@@ -98,10 +249,47 @@ struct simplefs_dentry {
 
 
 struct buffer_head *bitmap_load(struct super_block *sb, sector_t block);
-long bitmap_alloc_inode(struct super_block *sb);
+void bitmap_readahead(struct super_block *sb);
+int bitmap_find_set_bit(unsigned long *map, int nbits, int start);
+long bitmap_data_start(struct simplefs_super_info *sbi);
+int bitmap_reserve_inodes(struct super_block *sb, long *inos, int count);
+void bitmap_unreserve_inodes(struct super_block *sb, long *inos, int n);
 void bitmap_free_inode(struct super_block *sb, long ino);
-long bitmap_alloc_block(struct super_block *sb);
+int bitmap_reserve_blocks(struct super_block *sb, long goal, long *bnos, int count);
+void bitmap_unreserve_blocks(struct super_block *sb, long *bnos, int n);
+long bitmap_alloc_range(struct super_block *sb, int count, long goal);
 void bitmap_free_block(struct super_block *sb, long bno);
+int bitmap_block_shared(struct super_block *sb, long bno);
+int bitmap_get_block(struct super_block *sb, long bno);
+
+
+
+/* ioctl.c */
+
+/*
+ * Same numbers as FICLONE/FICLONERANGE (and the btrfs clone ioctls),
+ * so cp --reflink works unchanged.
+ */
+struct simplefs_clone_range {
+	__s64 src_fd;
+	__u64 src_offset;
+	__u64 src_length;
+	__u64 dest_offset;
+};
+#define SIMPLEFS_IOC_CLONE _IOW(0x94, 9, int)
+#define SIMPLEFS_IOC_CLONE_RANGE _IOW(0x94, 13, struct simplefs_clone_range)
+
+/* move the blocks of a file into one contiguous run */
+#define SIMPLEFS_IOC_DEFRAG _IO('s', 1)
+
+struct simplefs_heat {
+	__u32 h_reads;
+	__u32 h_writes;
+	__u32 h_hot;		/* blocks come from the hot region */
+};
+#define SIMPLEFS_IOC_GETHEAT _IOR('s', 2, struct simplefs_heat)
+
+long simplefs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 
 
@@ -117,10 +305,55 @@ extern const struct inode_operations simplefs_dir_inode_operations;
 /* file.c */
 extern const struct file_operations simplefs_file_operations;
 extern const struct inode_operations simplefs_file_inode_operations;
+int simplefs_fsync(struct file *file, struct dentry *dentry, int datasync);
 
 
 /* inode.c */
 extern const struct address_space_operations simplefs_aops;
 
+/* compress.c */
+extern const struct address_space_operations simplefs_compr_aops;
+void simplefs_compr_free(struct simplefs_super_info *sbi);
+
+/* device.c */
+int simplefs_open_devices(struct super_block *sb);
+void simplefs_close_devices(struct super_block *sb);
+struct block_device *simplefs_map_block(struct super_block *sb, long bno, sector_t *pblk);
+long simplefs_logical_block(struct super_block *sb, struct block_device *bdev, sector_t pblk);
+void simplefs_map_bh(struct buffer_head *bh, struct super_block *sb, long bno);
+struct buffer_head *simplefs_bread(struct super_block *sb, long bno);
+struct buffer_head *simplefs_getblk(struct super_block *sb, long bno);
+struct buffer_head *simplefs_bread_disk(struct super_block *sb, long bno);
+void simplefs_breadahead(struct super_block *sb, long bno);
+
+/* orphan.c */
+int simplefs_orphan_add(struct inode *inode);
+void simplefs_orphan_delete(struct inode *inode);
+void simplefs_orphan_work(struct work_struct *work);
+void simplefs_orphan_replay(struct super_block *sb);
+void simplefs_orphan_stop(struct super_block *sb);
+int simplefs_orphan_init(void);
+void simplefs_orphan_exit(void);
+
+/* reserve.c */
+long simplefs_reserve_inode(struct super_block *sb);
+long simplefs_reserve_block(struct super_block *sb, long goal);
+void simplefs_reserve_drain(struct super_block *sb);
+int simplefs_reserve_start(struct super_block *sb);
+void simplefs_reserve_stop(struct super_block *sb);
+
+/* heat.c */
+void simplefs_heat_touch(struct inode *inode, int write);
+void simplefs_heat_get(struct inode *inode, struct simplefs_heat *heat);
+long simplefs_alloc_goal(struct inode *inode);
+int simplefs_heat_placed(struct inode *inode, long bno);
+
+/* bench.c, built with make SIMPLEFS_BENCH=y */
+#ifdef SIMPLEFS_BENCH
+void simplefs_bench(void);
+#else
+static inline void simplefs_bench(void) {}
+#endif
+
 
 #endif /* __FS_SIMPLEFS_H__ */
@@ -12,21 +12,28 @@
 #include <linux/buffer_head.h>
 #include <asm-generic/bitops/find.h>
 #include <linux/writeback.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/mount.h>
 #include "simplefs.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 MODULE_LICENSE("Dual BSD/GPL");
 static struct kmem_cache *simplefs_inode_cachep;
 
 static const struct super_operations simplefs_super_operations;
 
 static void init_once(void *foo) {
-	struct inode *inode = foo;
-	inode_init_once(inode);
+	struct simplefs_inode_info *si = foo;
+	mutex_init(&si->i_compr_mutex);
+	inode_init_once(&si->vfs_inode);
 }
 
 static int init_inodecache(void) {
 	simplefs_inode_cachep = kmem_cache_create("simplefs_inode_cache",
-						  sizeof(struct inode),
+						  sizeof(struct simplefs_inode_info),
 						  0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD), init_once);
 	if (simplefs_inode_cachep == NULL) {
 		return -ENOMEM;
@@ -39,12 +46,56 @@ static void destroy_inodecache(void) {
 }
 
 
+enum {
+	Opt_lazytime, Opt_nolazytime, Opt_devices, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_lazytime, "lazytime"},
+	{Opt_nolazytime, "nolazytime"},
+	{Opt_devices, "devices=%s"},
+	{Opt_err, NULL}
+};
+
+static int simplefs_parse_options(char *options, struct simplefs_super_info *sbi, int remount) {
+	substring_t args[MAX_OPT_ARGS];
+	char *p, *devices;
+
+	if (!options)
+		return 0;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, tokens, args)) {
+		case Opt_lazytime:
+			sbi->s_mount_opt |= SIMPLEFS_MOUNT_LAZYTIME;
+			break;
+		case Opt_nolazytime:
+			sbi->s_mount_opt &= ~SIMPLEFS_MOUNT_LAZYTIME;
+			break;
+		case Opt_devices:
+			/* the devices are open for as long as we are mounted */
+			if (remount)
+				break;
+			if (!(devices = match_strdup(&args[0])))
+				return -ENOMEM;
+			kfree(sbi->s_devices);
+			sbi->s_devices = devices;
+			break;
+		default:
+			printk(KERN_ERR "Simplefs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 static int simplefs_fill_super(struct super_block *sb, void *data, int silent) {
 	struct buffer_head *bh;
 	struct simplefs_super *rsb;
 	struct simplefs_super_info *sbi;
 	struct inode *root;
-	int i, j, cnt, ret = 0;
+	int cnt, ret = 0;
 
 	printk(KERN_INFO "simplefs_fill_super\n");
 	if (!(bh = sb_bread(sb, SIMPLEFS_SUPER_BNO))) {
@@ -57,8 +108,19 @@ static int simplefs_fill_super(struct super_block *sb, void *data, int silent) {
 		goto out;
 	}
 	sbi->s_sb = bh;
+	spin_lock_init(&sbi->s_ref_lock);
+	mutex_init(&sbi->s_bitmap_mutex);
+	mutex_init(&sbi->s_flush_mutex);
+	mutex_init(&sbi->s_compr_mutex);
+	spin_lock_init(&sbi->s_orphan_lock);
+	INIT_DELAYED_WORK(&sbi->s_orphan_work, simplefs_orphan_work);
+	sbi->s_super = sb;
 	memcpy(&sbi->raw_super, bh->b_data, sizeof(sbi->raw_super));
 	sb->s_fs_info = sbi;
+	if ((ret = simplefs_parse_options(data, sbi, 0)))
+		goto failed_devices;
+	if ((ret = simplefs_open_devices(sb)))
+		goto failed_devices;
 	sb->s_blocksize = SIMPLEFS_BLOCKSIZE;
 	sb->s_flags = sb->s_flags & ~MS_POSIXACL;
 
@@ -85,30 +147,42 @@ static int simplefs_fill_super(struct super_block *sb, void *data, int silent) {
 
 	
 	cnt = sbi->raw_super.s_inode_bitmap_blknr + sbi->raw_super.s_block_bitmap_blknr;
+	ret = -ENOMEM;
 	if (!(sbi->s_bitmaps = kzalloc(sizeof(struct buffer_head *) * cnt, GFP_KERNEL)))
 		goto failed_bitmap;
-	for (i = 0, j = 0; i < cnt; i++) {
-		if (!(bh = bitmap_load(sb, SIMPLEFS_SUPER_BNO + 1 + i)))
-			goto failed_load;
-		sbi->s_bitmaps[j++] = bh;
-		printk(KERN_INFO "simplefs_fill_super bitmap ok:%d -> %d\n", cnt, i);
-	}
+	if (!(sbi->s_claimed = kzalloc(sizeof(unsigned long *) * cnt, GFP_KERNEL)))
+		goto failed_claimed;
 	rsb = &sbi->raw_super;
+	if (rsb->s_refcount_blknr &&
+	    !(sbi->s_refcounts = kzalloc(sizeof(struct buffer_head *) * rsb->s_refcount_blknr,
+					 GFP_KERNEL)))
+		goto failed_refcount;
+	if ((ret = simplefs_reserve_start(sb)))
+		goto failed_reserve;
+	/* bitmap blocks are read by the allocator when it first needs them */
+	bitmap_readahead(sb);
+	simplefs_orphan_replay(sb);
 	printk("fill super ok: (inode %d %d %d) (block %d %d %d)\n",
 	       rsb->s_inode_bitmap_blknr, rsb->s_inode_blknr, rsb->s_free_inodes_count,
 	       rsb->s_block_bitmap_blknr, rsb->s_block_blknr, rsb->s_free_blocks_count);
 	return 0;
- failed_load:
-	for (i = 0; i < j; i++) {
-		brelse(sbi->s_bitmaps[i]);
-	}
+ failed_reserve:
+	kfree(sbi->s_refcounts);
+ failed_refcount:
+	kfree(sbi->s_claimed);
+ failed_claimed:
+	kfree(sbi->s_bitmaps);
  failed_bitmap:
 	dput(sb->s_root);
+	sb->s_root = NULL;
  failed_root:
+	simplefs_close_devices(sb);
+ failed_devices:
+	kfree(sbi->s_devices);
 	kfree(sbi);
+	sb->s_fs_info = NULL;
  out:
 	brelse(bh);
-	sbi->s_sb = NULL;
 	printk("simplefs get sb failed.\n");
 	return ret;
 }
@@ -124,13 +198,30 @@ static void simplefs_put_sb(struct super_block *sb) {
 	struct simplefs_super_info *sbi = sb->s_fs_info;
 	cnt = sbi->raw_super.s_inode_bitmap_blknr + sbi->raw_super.s_block_bitmap_blknr;
 	printk(KERN_INFO "simplefs_put_sb: %d\n", cnt);
+	simplefs_orphan_stop(sb);
+	simplefs_reserve_stop(sb);
 	if (sbi->s_sb)
 		brelse(sbi->s_sb);
 	if (sbi->s_bitmaps) {
 		for (i = 0; i < cnt; i++) {
+			/* with the bits reserve_stop gave back */
+			if (sbi->s_bitmaps[i] && buffer_dirty(sbi->s_bitmaps[i]))
+				sync_dirty_buffer(sbi->s_bitmaps[i]);
 			brelse(sbi->s_bitmaps[i]);
+			kfree(sbi->s_claimed[i]);
 		}
+		kfree(sbi->s_bitmaps);
+		kfree(sbi->s_claimed);
 	}
+	if (sbi->s_refcounts) {
+		for (i = 0; i < sbi->raw_super.s_refcount_blknr; i++) {
+			brelse(sbi->s_refcounts[i]);
+		}
+		kfree(sbi->s_refcounts);
+	}
+	simplefs_compr_free(sbi);
+	simplefs_close_devices(sb);
+	kfree(sbi->s_devices);
 	kfree(sbi);
 	sb->s_fs_info = NULL;
 }
@@ -150,11 +241,17 @@ static int __init simplefs_init(void) {
 	int err = init_inodecache();
 	if (err)
 		return err;
+	if ((err = simplefs_orphan_init()))
+		goto out;
 	err = register_filesystem(&simplefs_fs_type);
 	if (err)
-		goto out;
+		goto out_orphan;
+	simplefs_dirhash_init();
+	simplefs_bench();
 	printk("Simple file system register ok\n");
 	return 0;
+ out_orphan:
+	simplefs_orphan_exit();
  out:
 	destroy_inodecache();
 	return err;
@@ -163,29 +260,66 @@ static int __init simplefs_init(void) {
 static void __exit simplefs_exit(void) {
 	printk("Simple file system unregister\n");
 	unregister_filesystem(&simplefs_fs_type);
+	simplefs_dirhash_exit();
+	simplefs_orphan_exit();
 	destroy_inodecache();
 }
 
+/*
+ * The blocks and the inode number are freed in the background, see
+ * orphan.c, so this takes the same time whatever the size of the file.
+ */
 static void simplefs_delete_inode(struct inode *inode) {
 	printk(KERN_INFO "simplefs_delete_inode: %ld\n", inode->i_ino);
 	truncate_inode_pages(&inode->i_data, 0);
-	inode->i_size = 0;
-	simplefs_truncate(inode);
-	simplefs_free_inode(inode);
+	simplefs_orphan_delete(inode);
+}
+
+/*
+ * With lazytime, an inode whose only change is its timestamp is not
+ * written by background writeback. It is kept dirty so writeback comes
+ * back to it, and it is written once the change is older than
+ * SIMPLEFS_LAZYTIME_EXPIRE, or by fsync, sync and unmount, which
+ * write with WB_SYNC_ALL. The block mapping is not affected, since
+ * simplefs_get_block updates the inode block directly.
+ */
+static int simplefs_lazy_time(struct inode *inode, struct writeback_control *wbc) {
+	struct simplefs_super_info *sbi = inode->i_sb->s_fs_info;
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
+
+	if (!(sbi->s_mount_opt & SIMPLEFS_MOUNT_LAZYTIME) || wbc->sync_mode == WB_SYNC_ALL)
+		return 0;
+	if (si->i_disk_size != inode->i_size || si->i_disk_nlink != inode->i_nlink ||
+	    si->i_disk_mode != (inode->i_mode | (si->i_flags << SIMPLEFS_FLAGS_SHIFT)))
+		return 0;
+	if (!si->i_lazy_since)
+		si->i_lazy_since = jiffies ? jiffies : 1;
+	if (time_after(jiffies, si->i_lazy_since + SIMPLEFS_LAZYTIME_EXPIRE))
+		return 0;
+	mark_inode_dirty_sync(inode);
+	return 1;
 }
 
 static int simplefs_write_inode(struct inode *inode, struct writeback_control *wbc) {
 	int err = 0;
 	struct buffer_head *bh;
 	struct simplefs_inode *raw_inode;
+	struct simplefs_inode_info *si = SIMPLEFS_I(inode);
 
+	if (simplefs_lazy_time(inode, wbc))
+		return 0;
 	printk(KERN_INFO "simplefs_write_inode: %ld\n", inode->i_ino);
 	if (!(raw_inode = simplefs_iget_raw(inode->i_sb, inode->i_ino, &bh)))
 		return -EIO;
-	raw_inode->i_mode = inode->i_mode;
+	raw_inode->i_mode = inode->i_mode |
+		(si->i_flags << SIMPLEFS_FLAGS_SHIFT);
 	raw_inode->i_nlink = inode->i_nlink;
 	raw_inode->i_size = inode->i_size;
 	raw_inode->i_time = inode->i_mtime.tv_sec;
+	si->i_disk_mode = raw_inode->i_mode;
+	si->i_disk_nlink = raw_inode->i_nlink;
+	si->i_disk_size = raw_inode->i_size;
+	si->i_lazy_since = 0;
 	mark_buffer_dirty(bh);
 	if (wbc->sync_mode == WB_SYNC_ALL && buffer_dirty(bh)) {
 		sync_dirty_buffer(bh);
@@ -195,13 +329,45 @@ static int simplefs_write_inode(struct inode *inode, struct writeback_control *w
 }
 
 static struct inode *simplefs_alloc_inode(struct super_block *sb) {
+	struct simplefs_inode_info *si;
+
 	printk(KERN_INFO "simplefs_alloc_inode\n");
-	return kmem_cache_alloc(simplefs_inode_cachep, GFP_KERNEL);
+	if (!(si = kmem_cache_alloc(simplefs_inode_cachep, GFP_KERNEL)))
+		return NULL;
+	si->i_flags = 0;
+	si->i_dirhash = NULL;
+	si->i_disk_mode = si->i_disk_nlink = si->i_disk_size = 0;
+	si->i_lazy_since = 0;
+	si->i_orphan = -1;
+	si->i_heat_reads = si->i_heat_writes = 0;
+	si->i_heat_stamp = jiffies;
+	return &si->vfs_inode;
 }
 
 static void simplefs_destroy_inode(struct inode *inode) {
 	printk(KERN_INFO "simplefs_destroy_inode\n");
-	kmem_cache_free(simplefs_inode_cachep, inode);
+	simplefs_dirhash_drop(inode);
+	kmem_cache_free(simplefs_inode_cachep, SIMPLEFS_I(inode));
+}
+
+static int simplefs_remount(struct super_block *sb, int *flags, char *data) {
+	struct simplefs_super_info *sbi = sb->s_fs_info;
+	unsigned long old_opt = sbi->s_mount_opt;
+	int err;
+
+	if ((err = simplefs_parse_options(data, sbi, 1)))
+		sbi->s_mount_opt = old_opt;
+	return err;
+}
+
+static int simplefs_show_options(struct seq_file *seq, struct vfsmount *vfs) {
+	struct simplefs_super_info *sbi = vfs->mnt_sb->s_fs_info;
+
+	if (sbi->s_mount_opt & SIMPLEFS_MOUNT_LAZYTIME)
+		seq_puts(seq, ",lazytime");
+	if (sbi->s_devices)
+		seq_printf(seq, ",devices=%s", sbi->s_devices);
+	return 0;
 }
 
 static const struct super_operations simplefs_super_operations = {
@@ -212,7 +378,8 @@ static const struct super_operations simplefs_super_operations = {
 	.write_super = NULL,
 	.put_super = simplefs_put_sb,
 	.statfs = NULL,
-	.remount_fs = NULL,
+	.remount_fs = simplefs_remount,
+	.show_options = simplefs_show_options,
 };
 
 
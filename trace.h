@@ -0,0 +1,124 @@
+/*
+ * linux/fs/sfs/trace.h
+ *
+ * Copyright (C) 2013
+ * fangdong@pipul.org
+ */
+
+/*
+ * Tracepoints for the VFS operations, under events/simplefs in the
+ * tracing directory. trace.sh records them and cmd/replay runs the
+ * recording against another mount, so the output format is what
+ * cmd/replay parses: key=value pairs, with the name last.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM simplefs
+
+#if !defined(_TRACE_SIMPLEFS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_SIMPLEFS_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(simplefs_name,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ino),
+	TP_ARGS(dir, dentry, ino),
+	TP_STRUCT__entry(
+		__field(unsigned long, dir)
+		__field(long, ino)
+		__array(char, name, SIMPLEFS_NAME_LEN + 1)
+	),
+	TP_fast_assign(
+		unsigned len = min_t(unsigned, dentry->d_name.len, SIMPLEFS_NAME_LEN);
+
+		__entry->dir = dir->i_ino;
+		__entry->ino = ino;
+		memcpy(__entry->name, dentry->d_name.name, len);
+		__entry->name[len] = 0;
+	),
+	TP_printk("dir=%lu ino=%ld name=%s", __entry->dir, __entry->ino, __entry->name)
+);
+
+/* ino is -1 when the name was not found */
+DEFINE_EVENT(simplefs_name, simplefs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(simplefs_name, simplefs_create,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(simplefs_name, simplefs_mkdir,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DEFINE_EVENT(simplefs_name, simplefs_unlink,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, long ino),
+	TP_ARGS(dir, dentry, ino)
+);
+
+DECLARE_EVENT_CLASS(simplefs_rw,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len),
+	TP_STRUCT__entry(
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(size_t, len)
+	),
+	TP_fast_assign(
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+	),
+	TP_printk("ino=%lu pos=%lld len=%zu", __entry->ino, __entry->pos, __entry->len)
+);
+
+DEFINE_EVENT(simplefs_rw, simplefs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len)
+);
+
+DEFINE_EVENT(simplefs_rw, simplefs_write,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+	TP_ARGS(inode, pos, len)
+);
+
+TRACE_EVENT(simplefs_readdir,
+	TP_PROTO(struct inode *inode, loff_t pos),
+	TP_ARGS(inode, pos),
+	TP_STRUCT__entry(
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+	),
+	TP_fast_assign(
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+	),
+	TP_printk("ino=%lu pos=%lld", __entry->ino, __entry->pos)
+);
+
+TRACE_EVENT(simplefs_fsync,
+	TP_PROTO(struct inode *inode, int datasync),
+	TP_ARGS(inode, datasync),
+	TP_STRUCT__entry(
+		__field(unsigned long, ino)
+		__field(int, datasync)
+	),
+	TP_fast_assign(
+		__entry->ino = inode->i_ino;
+		__entry->datasync = datasync;
+	),
+	TP_printk("ino=%lu datasync=%d", __entry->ino, __entry->datasync)
+);
+
+#endif /* _TRACE_SIMPLEFS_H */
+
+/* this part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# Record the simplefs tracepoints until interrupted, for cmd/replay.
+# usage: trace.sh [output]
+
+tracing=/sys/kernel/debug/tracing
+out=${1:-simplefs.trace}
+
+if [ ! -d $tracing ]; then
+	mount -t debugfs nodev /sys/kernel/debug || exit 1
+fi
+echo > $tracing/trace
+echo 1 > $tracing/events/simplefs/enable || exit 1
+trap 'echo 0 > $tracing/events/simplefs/enable' EXIT
+trap 'exit 0' INT TERM
+cat $tracing/trace_pipe > "$out"